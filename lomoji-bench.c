@@ -0,0 +1,528 @@
+/* lomoji-bench.c - Last Outpost Emoji Translation Library */
+/* Created: Sat Oct 17 09:12:40 AM EDT 2026 malakai */
+/* Copyright © 2024 Jeffrika Heavy Industries */
+/* $Id$ */
+
+/* Copyright © 2024 Jeff Jahr <malakai@jeffrika.com>
+ *
+ * This file is part of liblomoji - Last Outpost Emoji Translation Library
+ *
+ * liblomoji is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * liblomoji is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with liblomoji.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Times the translators over a synthetic corpus, and prints one tab separated
+ * line of results for each workload, filter list and call.  The corpus comes
+ * from a fixed seed, so two runs with the same arguments translate the same
+ * text, and their output can be compared line for line.  Lines starting with
+ * '#' are comments. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "lomoji.h"
+#include "lomoji-bench.h"
+
+#define BENCH_LINES 2000	/* lines in each workload. */
+#define BENCH_REPS 5		/* timed passes over each workload. */
+#define BENCH_SUGGEST 10	/* max suggestions to ask for. */
+
+/* what gets called. */
+typedef enum {
+	API_TO_EXT,
+	API_TO_INTO,
+	API_FROM_EXT,
+	API_FROM_INTO,
+	API_SUGGEST
+} bench_api;
+
+static const char *api_names[] = {
+	"to_ascii_ext",
+	"to_ascii_into",
+	"from_ascii_ext",
+	"from_ascii_into",
+	"suggest_ext"
+};
+
+/* one kind of text, and what's in it. */
+typedef struct {
+	const char *name;
+	GPtrArray *lines;
+	gsize bytes;
+	gsize graphemes;
+} workload_t;
+
+/* a named filter list. */
+typedef struct {
+	const char *name;
+	lomoji_filter **filters;
+} bench_list_t;
+
+static bench_list_t to_lists[] = {
+	{ "toascii", lomoji_toascii },
+	{ "namesonly", lomoji_namesonly },
+	{ "nameuplus", lomoji_nameuplus },
+	{ "iconv", lomoji_iconv },
+	{ "uplusonly", lomoji_uplusonly },
+	{ "none", lomoji_none },
+	{ NULL, NULL }
+};
+
+static bench_list_t from_lists[] = {
+	{ "fromascii", lomoji_fromascii },
+	{ "none", lomoji_none },
+	{ NULL, NULL }
+};
+
+static const char *mud_words[] = {
+	"You", "see", "a", "rusty", "longsword", "lying", "here.", "The",
+	"goblin", "hits", "you", "for", "12", "damage!", "Exits:", "north",
+	"south", "east", "up.", "[HP:143/200", "MV:88/90]", "Malakai", "says,",
+	"'Anyone", "want", "to", "group?'", "A", "torch", "flickers", "on", "the",
+	"wall.", "gold", "coins", "(glowing)", "<Tell>", "#3", "is", "dead!"
+};
+
+static const char *chat_words[] = {
+	"lol", "gg", "brb", "omg", "that", "was", "awesome", "thanks", "see",
+	"you", "tonight", "raid", "at", "9", "who", "has", "the", "key?", "nice",
+	"haha", "ok", "yes", "no", "wait", "for", "me"
+};
+
+/* single codepoint emoji, with and without a variation selector. */
+static const char *emoji_singles[] = {
+	"😀", "😂", "❤️", "👍", "🎉", "🔥", "✨", "🙏", "😭", "🤔", "⚔️", "🛡️",
+	"🐉", "💰", "🍺", "☕", "⭐", "✅", "❌", "💀", "©", "é"
+};
+
+/* multi codepoint sequences: skin tones, zwj, flags, keycaps and tags. */
+static const char *emoji_seqs[] = {
+	"👍🏽", "👋🏻", "🙏🏿", "👨‍👩‍👧‍👦", "👩‍💻", "🧑🏾‍🚀", "🏳️‍🌈", "❤️‍🔥",
+	"🇺🇸", "🇩🇪", "🇯🇵", "#️⃣", "1️⃣", "🏴󠁧󠁢󠁳󠁣󠁴󠁿", "👩🏽‍❤️‍👨🏻"
+};
+
+static guint64 rng_state;
+
+/* xorshift64*, so the corpus doesn't depend on the libc's rand(). */
+static guint32 rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return((guint32)((rng_state * 0x2545f4914f6cdd1dULL) >> 32));
+}
+
+#define PICK(array) ((array)[rng() % G_N_ELEMENTS(array)])
+
+#if defined(__GLIBC__)
+/* count calls to the allocator, by standing in front of glibc's.  glib's
+ * g_malloc() and friends all end up here. */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t m);
+extern void *__libc_realloc(void *p, size_t n);
+
+static gsize allocs;
+
+void *malloc(size_t n) {
+	allocs++;
+	return(__libc_malloc(n));
+}
+
+void *calloc(size_t n, size_t m) {
+	allocs++;
+	return(__libc_calloc(n,m));
+}
+
+void *realloc(void *p, size_t n) {
+	allocs++;
+	return(__libc_realloc(p,n));
+}
+#define ALLOCS_COUNTED 1
+#else
+static gsize allocs;
+#define ALLOCS_COUNTED 0
+#endif
+
+static guint64 now_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return((guint64)t.tv_sec * 1000000000ULL + t.tv_nsec);
+}
+
+/* roughly how many graphemes are in s: every codepoint, less the ones that
+ * modify or join on to the one before, and counting a pair of regional
+ * indicators as one flag. */
+static gsize count_graphemes(const char *s) {
+	gsize n = 0;
+	int join = 0, flag = 0;
+
+	for(const char *p = s;*p;p = g_utf8_next_char(p)) {
+		gunichar c = g_utf8_get_char(p);
+
+		if(join || g_unichar_iszerowidth(c) || (c >= 0x1f3fb && c <= 0x1f3ff)) {
+			join = (c == 0x200d);
+			continue;
+		}
+		if(c >= 0x1f1e6 && c <= 0x1f1ff) {
+			if( (flag = !flag) == 0 ) continue;
+		} else {
+			flag = 0;
+		}
+		n++;
+	}
+	return(n);
+}
+
+static workload_t *workload_new(const char *name) {
+	workload_t *w = g_new0(workload_t,1);
+
+	w->name = name;
+	w->lines = g_ptr_array_new_with_free_func(g_free);
+	return(w);
+}
+
+static void workload_add(workload_t *w, GString *line) {
+	g_ptr_array_add(w->lines,g_strdup(line->str));
+	w->bytes += line->len;
+	w->graphemes += count_graphemes(line->str);
+}
+
+static void workload_free(workload_t *w) {
+	g_ptr_array_free(w->lines,TRUE);
+	g_free(w);
+}
+
+/* game output: long lines of plain ascii, with an emoji now and then. */
+static workload_t *make_mud(int lines) {
+	workload_t *w = workload_new("mud");
+	GString *line = g_string_new("");
+
+	for(int i=0;i<lines;i++) {
+		gsize want = 60 + rng() % 60;
+		int emoji = (rng() % 40 == 0);
+
+		g_string_truncate(line,0);
+		while(line->len < want) {
+			if(line->len) g_string_append_c(line,' ');
+			if(emoji && rng() % 8 == 0) {
+				g_string_append(line,PICK(emoji_singles));
+				emoji = 0;
+			} else {
+				g_string_append(line,PICK(mud_words));
+			}
+		}
+		g_string_append(line,"\r\n");
+		workload_add(w,line);
+	}
+	g_string_free(line,TRUE);
+	return(w);
+}
+
+/* player chat: short lines, and lots of emoji. */
+static workload_t *make_chat(int lines) {
+	workload_t *w = workload_new("chat");
+	GString *line = g_string_new("");
+
+	for(int i=0;i<lines;i++) {
+		int words = 2 + rng() % 9;
+
+		g_string_truncate(line,0);
+		for(int j=0;j<words;j++) {
+			if(j) g_string_append_c(line,' ');
+			switch(rng() % 10) {
+				case 0:
+				case 1:
+					g_string_append(line,PICK(emoji_singles));
+					break;
+				case 2:
+					g_string_append(line,PICK(emoji_seqs));
+					break;
+				default:
+					g_string_append(line,PICK(chat_words));
+					break;
+			}
+		}
+		workload_add(w,line);
+	}
+	g_string_free(line,TRUE);
+	return(w);
+}
+
+/* nothing but the hard cases. */
+static workload_t *make_zwj(int lines) {
+	workload_t *w = workload_new("zwj");
+	GString *line = g_string_new("");
+
+	for(int i=0;i<lines;i++) {
+		int seqs = 3 + rng() % 10;
+
+		g_string_truncate(line,0);
+		for(int j=0;j<seqs;j++) {
+			if(j && rng() % 2) g_string_append_c(line,' ');
+			g_string_append(line,PICK(emoji_seqs));
+		}
+		workload_add(w,line);
+	}
+	g_string_free(line,TRUE);
+	return(w);
+}
+
+/* chat as typed with :name: markup, which is what the chat lines come out as
+ * with lomoji_namesonly, and some names that don't exist. */
+static workload_t *make_markup(lomoji_ctx_t *ctx, workload_t *chat) {
+	workload_t *w = workload_new("markup");
+	GString *line = g_string_new("");
+	const char *prefix = lomoji_get_param_ext(ctx,LOMOJI_PREFIX);
+	const char *suffix = lomoji_get_param_ext(ctx,LOMOJI_SUFFIX);
+
+	for(guint i=0;i<chat->lines->len;i++) {
+		g_string_truncate(line,0);
+		lomoji_to_ascii_into(ctx,g_ptr_array_index(chat->lines,i),lomoji_namesonly,line);
+		if(rng() % 5 == 0) {
+			g_string_append_printf(line," %sno_such_thing%s",prefix,suffix);
+		}
+		if(rng() % 10 == 0) {
+			g_string_append_printf(line," odds are 3%s1",prefix);
+		}
+		workload_add(w,line);
+	}
+	g_string_free(line,TRUE);
+	return(w);
+}
+
+/* the first few characters of the names in the markup, as they would be
+ * typed ahead of a tab completion. */
+static workload_t *make_suggest(lomoji_ctx_t *ctx, workload_t *markup, int lines) {
+	workload_t *w = workload_new("suggest");
+	GString *line = g_string_new("");
+	const char *prefix = lomoji_get_param_ext(ctx,LOMOJI_PREFIX);
+	gsize prefixlen = strlen(prefix);
+
+	for(guint i=0;i<markup->lines->len && w->lines->len < (guint)lines;i++) {
+		const char *p = g_ptr_array_index(markup->lines,i);
+
+		while(prefixlen && (p = strstr(p,prefix))) {
+			const char *name = p + prefixlen;
+			const char *end = name;
+			int chars = 1 + rng() % 5;
+
+			while(chars-- && *end && !g_unichar_isspace(g_utf8_get_char(end))) {
+				end = g_utf8_next_char(end);
+			}
+			if(end != name) {
+				g_string_truncate(line,0);
+				g_string_append_len(line,p,end-p);
+				workload_add(w,line);
+			}
+			p = end;
+		}
+	}
+	/* a context with no names still gets something to look for. */
+	for(int c='a';w->lines->len == 0 && c<='z';c++) {
+		g_string_printf(line,"%s%c",prefix,c);
+		workload_add(w,line);
+	}
+	g_string_free(line,TRUE);
+	return(w);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+
+	return((x > y) - (x < y));
+}
+
+static void call(lomoji_ctx_t *ctx, bench_api api, lomoji_filter **filters, char *src, GString *buf) {
+	switch(api) {
+		case API_TO_EXT:
+			free(lomoji_to_ascii_ext(ctx,src,filters));
+			break;
+		case API_TO_INTO:
+			g_string_truncate(buf,0);
+			lomoji_to_ascii_into(ctx,src,filters,buf);
+			break;
+		case API_FROM_EXT:
+			free(lomoji_from_ascii_ext(ctx,src,filters));
+			break;
+		case API_FROM_INTO:
+			g_string_truncate(buf,0);
+			lomoji_from_ascii_into(ctx,src,filters,buf);
+			break;
+		case API_SUGGEST:
+			free(lomoji_suggest_ext(ctx,src,BENCH_SUGGEST,NULL));
+			break;
+	}
+}
+
+/* time every call of reps passes over w, after one pass to warm up. */
+static void bench(lomoji_ctx_t *ctx, workload_t *w, const char *listname, lomoji_filter **filters, bench_api api, int reps) {
+	guint n = w->lines->len;
+	gsize calls = (gsize)n * reps;
+	guint64 *lat, total = 0;
+	gsize allocs_was;
+	GString *buf = g_string_sized_new(1024);
+	double secs;
+
+	if(!n || reps <= 0) {
+		g_string_free(buf,TRUE);
+		return;
+	}
+	lat = g_new(guint64,calls);
+
+	for(guint i=0;i<n;i++) {
+		call(ctx,api,filters,g_ptr_array_index(w->lines,i),buf);
+	}
+
+	allocs_was = allocs;
+	for(int r=0;r<reps;r++) {
+		for(guint i=0;i<n;i++) {
+			guint64 t = now_ns();
+			call(ctx,api,filters,g_ptr_array_index(w->lines,i),buf);
+			lat[(gsize)r*n + i] = now_ns() - t;
+		}
+	}
+	allocs_was = allocs - allocs_was;
+
+	for(gsize i=0;i<calls;i++) {
+		total += lat[i];
+	}
+	qsort(lat,calls,sizeof(*lat),cmp_u64);
+	secs = total / 1e9;
+
+	fprintf(stdout,"%s\t%s\t%s\t%zu\t%zu\t%zu\t%.2f\t%.1f\t",
+		w->name,listname,api_names[api],calls,w->bytes*reps,w->graphemes*reps,
+		secs > 0 ? (w->bytes*reps) / secs / 1e6 : 0.0,
+		w->graphemes ? (double)total / (w->graphemes*reps) : 0.0
+	);
+	if(ALLOCS_COUNTED) {
+		fprintf(stdout,"%.2f\t",(double)allocs_was / calls);
+	} else {
+		fprintf(stdout,"NA\t");
+	}
+	fprintf(stdout,"%llu\t%llu\n",
+		(unsigned long long)lat[calls / 2],
+		(unsigned long long)lat[calls - 1 - calls / 100]
+	);
+	fflush(stdout);
+
+	g_free(lat);
+	g_string_free(buf,TRUE);
+}
+
+static void usage(const char *me) {
+	fprintf(stderr,"%s [options] [annotations.xml ...]:\n",me);
+	fprintf(stderr,"\t-h this message\n");
+	fprintf(stderr,"\t-l <lines> lines in each workload (%d)\n",BENCH_LINES);
+	fprintf(stderr,"\t-r <reps> timed passes over each workload (%d)\n",BENCH_REPS);
+	fprintf(stderr,"\t-s <seed> seed for the synthetic corpus (1)\n");
+	fprintf(stderr,"\t-z freeze the context first\n");
+	fprintf(stderr,"With no annotation files, the default ones are used.\n");
+}
+
+int main(int argc, char *argv[]) {
+
+	int lines = BENCH_LINES;
+	int reps = BENCH_REPS;
+	guint64 seed = 1;
+	int freeze = 0;
+	int opt;
+	lomoji_ctx_t *ctx;
+	workload_t *mud, *chat, *zwj, *markup, *suggest;
+	workload_t *to_work[4];
+
+	while( (opt = getopt(argc,argv,"hl:r:s:z")) != -1) {
+		switch(opt) {
+			case 'l':
+				lines = atoi(optarg);
+				break;
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg,NULL,0);
+				break;
+			case 'z':
+				freeze = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	if(lines <= 0 || reps <= 0) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if(optind < argc) {
+		ctx = lomoji_ctx_new(argv + optind);
+	} else {
+		lomoji_init_filepaths();
+		ctx = lomoji_ctx_new(lomoji_default_filepaths);
+	}
+	if(!ctx) {
+		fprintf(stderr,"%s: couldn't set up a context: %s\n",argv[0],strerror(errno));
+		exit(1);
+	}
+	if(freeze && lomoji_ctx_freeze(ctx)) {
+		fprintf(stderr,"%s: couldn't freeze the context: %s\n",argv[0],strerror(errno));
+		exit(1);
+	}
+
+	/* xorshift never gets out of 0. */
+	rng_state = seed ? seed : 1;
+	mud = make_mud(lines);
+	chat = make_chat(lines);
+	zwj = make_zwj(lines);
+	markup = make_markup(ctx,chat);
+	suggest = make_suggest(ctx,markup,lines);
+
+	fprintf(stdout,"# lomoji-bench %s seed=%llu lines=%d reps=%d frozen=%d allocs=%s\n",
+		LOMOJI_VERSION,(unsigned long long)seed,lines,reps,freeze,
+		ALLOCS_COUNTED ? "counted" : "NA"
+	);
+	fprintf(stdout,"workload\tfilters\tcall\tcalls\tbytes\tgraphemes\tmb_per_s\tns_per_grapheme\tallocs_per_call\tp50_ns\tp99_ns\n");
+
+	to_work[0] = mud;
+	to_work[1] = chat;
+	to_work[2] = zwj;
+	to_work[3] = NULL;
+	for(int i=0;to_work[i];i++) {
+		for(bench_list_t *l = to_lists;l->name;l++) {
+			bench(ctx,to_work[i],l->name,l->filters,API_TO_EXT,reps);
+			bench(ctx,to_work[i],l->name,l->filters,API_TO_INTO,reps);
+		}
+	}
+	for(bench_list_t *l = from_lists;l->name;l++) {
+		bench(ctx,markup,l->name,l->filters,API_FROM_EXT,reps);
+		bench(ctx,markup,l->name,l->filters,API_FROM_INTO,reps);
+		bench(ctx,mud,l->name,l->filters,API_FROM_INTO,reps);
+	}
+	bench(ctx,suggest,"-",NULL,API_SUGGEST,reps);
+
+	/* clean up your mess. */
+	workload_free(mud);
+	workload_free(chat);
+	workload_free(zwj);
+	workload_free(markup);
+	workload_free(suggest);
+	lomoji_ctx_free(ctx);
+	if(optind >= argc) {
+		lomoji_done_filepaths();
+	}
+
+	exit(0);
+}
@@ -0,0 +1,36 @@
+/* lomoji-bench.h - Last Outpost Emoji Translation Library */
+/* Created: Sat Oct 17 09:12:40 AM EDT 2026 malakai */
+/* Copyright © 2024 Jeffrika Heavy Industries */
+/* $Id$ */
+
+/* Copyright © 2024 Jeff Jahr <malakai@jeffrika.com>
+ *
+ * This file is part of liblomoji - Last Outpost Emoji Translation Library
+ *
+ * liblomoji is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * liblomoji is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with liblomoji.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JHI_LOMOJI_BENCH_H
+#define JHI_LOMOJI_BENCH_H
+
+/* global #defines */
+
+/* structs and typedefs */
+
+/* exported global variable declarations */
+
+/* exported function declarations */
+
+
+#endif /* JHI_LOMOJI_BENCH_H */
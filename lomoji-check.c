@@ -0,0 +1,391 @@
+/* lomoji-check.c - Last Outpost Emoji Translation Library */
+/* Created: Sat Oct 17 02:51:07 PM EDT 2026 malakai */
+/* Copyright © 2024 Jeffrika Heavy Industries */
+/* $Id$ */
+
+/* Copyright © 2024 Jeff Jahr <malakai@jeffrika.com>
+ *
+ * This file is part of liblomoji - Last Outpost Emoji Translation Library
+ *
+ * liblomoji is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * liblomoji is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with liblomoji.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the shortcuts come out the same as doing things the long way.
+ * A context reopened from a snapshot, one that has been refreshed after its
+ * annotation files changed, and a stream fed a few bytes at a time, are each
+ * compared with a context freshly built from the same files.  The files are
+ * copied into a temporary directory first, since the refresh check edits
+ * them.  Prints one line for each check, and exits non-zero if any failed. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "lomoji.h"
+#include "lomoji-check.h"
+
+#define CHECK_PER_LINE 8	/* codepoints in each line of the corpus. */
+#define CHECK_SUGGEST 20	/* max suggestions to ask for. */
+
+/* what the refresh check adds to the first file. */
+#define CHECK_NEW_CP "☃"
+#define CHECK_NEW_XML \
+	"\t\t<annotation cp=\"" CHECK_NEW_CP "\" type=\"tts\">check snowman</annotation>\n" \
+	"\t\t<annotation cp=\"" CHECK_NEW_CP "\">frosty | check snow</annotation>\n"
+#define CHECK_ALIAS "check_added"
+
+static int failures;
+
+/* add every cp="..." in an annotations file to cps. */
+static void corpus_scan(GHashTable *cps, const gchar *xml) {
+	const gchar *p = xml, *end;
+
+	while( (p = strstr(p,"cp=\"")) ) {
+		p += 4;
+		if( !(end = strchr(p,'"')) ) break;
+		if(end > p) g_hash_table_add(cps,g_strndup(p,end-p));
+		p = end;
+	}
+}
+
+/* lines of text with the codepoints in them, and some ascii around them. */
+static GPtrArray *corpus_lines(GHashTable *cps) {
+	GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+	GList *keys = g_list_sort(g_hash_table_get_keys(cps),(GCompareFunc)strcmp);
+	GString *line = g_string_new("");
+	int n = 0;
+
+	for(GList *k = keys;k;k = k->next) {
+		g_string_append_printf(line,"%s%s",(n % 3) ? " " : " word ",(gchar *)k->data);
+		if(++n % CHECK_PER_LINE == 0 || !k->next) {
+			g_ptr_array_add(lines,g_string_free(line,FALSE));
+			line = g_string_new("");
+		}
+	}
+	g_string_free(line,TRUE);
+	g_list_free(keys);
+	return(lines);
+}
+
+/* everything a context says about the corpus, one answer to a line. */
+static GString *dump(lomoji_ctx_t *ctx, GPtrArray *lines) {
+	GString *out = g_string_sized_new(1<<16);
+	GString *names = g_string_new("");
+	const char *prefix = lomoji_get_param_ext(ctx,LOMOJI_PREFIX);
+	const char *suffix = lomoji_get_param_ext(ctx,LOMOJI_SUFFIX);
+	gsize prefixlen = strlen(prefix);
+
+	for(guint i=0;i<lines->len;i++) {
+		const char *src = g_ptr_array_index(lines,i);
+		const char *p;
+
+		lomoji_to_ascii_into(ctx,src,lomoji_toascii,out);
+		g_string_append_c(out,'\n');
+		g_string_truncate(names,0);
+		lomoji_to_ascii_into(ctx,src,lomoji_namesonly,names);
+		g_string_append_printf(names," %s%s%s",prefix,CHECK_ALIAS,suffix);
+		g_string_append_printf(out,"%s\n",names->str);
+		lomoji_from_ascii_into(ctx,names->str,lomoji_fromascii,out);
+		g_string_append_c(out,'\n');
+
+		/* complete the first character or two of each name. */
+		for(p = names->str;prefixlen && (p = strstr(p,prefix));p += prefixlen) {
+			for(int chars=1;chars<=2 && p[prefixlen];chars++) {
+				const char *end = g_utf8_offset_to_pointer(p+prefixlen,chars);
+				gchar *in = g_strndup(p,end-p);
+				char *s = lomoji_suggest_ext(ctx,in,CHECK_SUGGEST,NULL);
+
+				g_string_append_printf(out,"%s -> %s\n",in,s ? s : "(null)");
+				free(s);
+				g_free(in);
+				if(!*end) break;
+			}
+		}
+	}
+	g_string_free(names,TRUE);
+	return(out);
+}
+
+/* print how a check went, and the first line where got and want differ. */
+static void report(const char *what, const gchar *got, const gchar *want) {
+	const gchar *g = got, *w = want;
+	int line = 1;
+
+	if(!strcmp(got,want)) {
+		fprintf(stdout,"ok\t%s\n",what);
+		return;
+	}
+	failures++;
+	while(*g && *g == *w) {
+		if(*g == '\n') line++;
+		g++;
+		w++;
+	}
+	fprintf(stdout,"FAIL\t%s: differs at line %d\n",what,line);
+	fprintf(stdout,"\tgot:  %.*s\n",(int)strcspn(g,"\n"),g);
+	fprintf(stdout,"\twant: %.*s\n",(int)strcspn(w,"\n"),w);
+}
+
+static void compare(const char *what, lomoji_ctx_t *ctx, lomoji_ctx_t *fresh, GPtrArray *lines) {
+	GString *got, *want;
+
+	if(!ctx) {
+		failures++;
+		fprintf(stdout,"FAIL\t%s: no context: %s\n",what,strerror(errno));
+		return;
+	}
+	got = dump(ctx,lines);
+	want = dump(fresh,lines);
+	report(what,got->str,want->str);
+	g_string_free(got,TRUE);
+	g_string_free(want,TRUE);
+}
+
+/* save fresh, open it again, and see that it's served from the snapshot. */
+static void check_snapshot(lomoji_ctx_t *fresh, const char *dir, GPtrArray *lines) {
+	gchar *path = g_build_filename(dir,"check.snap",NULL);
+	lomoji_ctx_t *ctx;
+
+	if(lomoji_ctx_save(fresh,path)) {
+		failures++;
+		fprintf(stdout,"FAIL\tsnapshot: couldn't save: %s\n",strerror(errno));
+		g_free(path);
+		return;
+	}
+	ctx = lomoji_ctx_open_snapshot(path);
+	if(ctx && errno) {
+		failures++;
+		fprintf(stdout,"FAIL\tsnapshot: was rebuilt from the xml: %s\n",strerror(errno));
+	}
+	compare("snapshot",ctx,fresh,lines);
+	if(ctx) lomoji_ctx_free(ctx);
+	unlink(path);
+	g_free(path);
+}
+
+/* feed text to a stream chunk bytes at a time. */
+static GString *stream(lomoji_stream_t *s, const gchar *text, gsize chunk) {
+	GString *out = g_string_new("");
+	gsize len = strlen(text);
+
+	for(gsize at = 0;at < len;at += chunk) {
+		lomoji_stream_feed(s,text + at,MIN(chunk,len - at),out);
+	}
+	lomoji_stream_flush(s,out);
+	return(out);
+}
+
+static void check_stream(lomoji_ctx_t *fresh, GPtrArray *lines) {
+	static const gsize chunks[] = { 1, 2, 3, 5, 7, 64, 4096 };
+	GString *text = g_string_new(""), *markup = g_string_new("");
+	GString *want_to = g_string_new(""), *want_from = g_string_new("");
+
+	for(guint i=0;i<lines->len;i++) {
+		g_string_append_printf(text,"%s\n",(gchar *)g_ptr_array_index(lines,i));
+	}
+	lomoji_to_ascii_into(fresh,text->str,lomoji_namesonly,markup);
+	lomoji_to_ascii_into(fresh,text->str,lomoji_toascii,want_to);
+	lomoji_from_ascii_into(fresh,markup->str,lomoji_fromascii,want_from);
+
+	for(guint i=0;i<G_N_ELEMENTS(chunks);i++) {
+		lomoji_stream_t *s;
+		GString *got;
+		gchar *what;
+
+		s = lomoji_stream_to_ascii(fresh,lomoji_toascii);
+		got = stream(s,text->str,chunks[i]);
+		what = g_strdup_printf("stream to_ascii, %zu byte chunks",chunks[i]);
+		report(what,got->str,want_to->str);
+		g_free(what);
+		g_string_free(got,TRUE);
+		lomoji_stream_free(s);
+
+		s = lomoji_stream_from_ascii(fresh,lomoji_fromascii);
+		got = stream(s,markup->str,chunks[i]);
+		what = g_strdup_printf("stream from_ascii, %zu byte chunks",chunks[i]);
+		report(what,got->str,want_from->str);
+		g_free(what);
+		g_string_free(got,TRUE);
+		lomoji_stream_free(s);
+	}
+	g_string_free(text,TRUE);
+	g_string_free(markup,TRUE);
+	g_string_free(want_to,TRUE);
+	g_string_free(want_from,TRUE);
+}
+
+/* change the first file: rename its first tts, drop the annotation after
+ * that, and add a new codepoint with a tts and aliases.  Returns the new
+ * contents, or NULL if it doesn't look like an annotations file. */
+static gchar *edit_annotations(const gchar *xml) {
+	const gchar *tts = strstr(xml,"type=\"tts\">");
+	const gchar *drop, *dropend, *close;
+	GString *out;
+
+	if(!tts || !(close = strstr(xml,"</annotations>"))) return(NULL);
+	tts += strlen("type=\"tts\">");
+	if( !(drop = strstr(tts,"<annotation ")) || drop > close ) return(NULL);
+	if( !(dropend = strstr(drop,"</annotation>")) || dropend > close ) return(NULL);
+	dropend += strlen("</annotation>");
+
+	out = g_string_new("");
+	g_string_append_len(out,xml,tts-xml);
+	g_string_append(out,"changed ");
+	g_string_append_len(out,tts,drop-tts);
+	g_string_append_len(out,dropend,close-dropend);
+	g_string_append(out,CHECK_NEW_XML);
+	g_string_append(out,close);
+	return(g_string_free(out,FALSE));
+}
+
+/* make a refreshable and a plain context, add an alias to each, change the
+ * first file, refresh them, and compare them with a context built from the
+ * changed files.  The new codepoint is in the corpus, so a refresh that
+ * missed the change doesn't pass. */
+static void check_refresh(char **paths, GHashTable *cps) {
+	lomoji_ctx_t *ctx[2], *fresh;
+	const char *what[2] = { "refresh, refreshable context", "refresh, plain context" };
+	gchar *first_cp = NULL;
+	gchar *xml, *edited;
+	GPtrArray *lines;
+	GHashTableIter it;
+	gpointer key;
+
+	ctx[0] = lomoji_ctx_new_refreshable(paths);
+	ctx[1] = lomoji_ctx_new(paths);
+
+	/* an alias that was added by hand has to survive the refresh. */
+	g_hash_table_iter_init(&it,cps);
+	while(g_hash_table_iter_next(&it,&key,NULL)) {
+		if(!first_cp || strcmp(key,first_cp) < 0) {
+			g_free(first_cp);
+			first_cp = g_strdup(key);
+		}
+	}
+	for(int i=0;i<2;i++) {
+		if(ctx[i] && first_cp) lomoji_add_alias(ctx[i],CHECK_ALIAS,first_cp);
+	}
+
+	if(!g_file_get_contents(paths[0],&xml,NULL,NULL) || !(edited = edit_annotations(xml))) {
+		failures++;
+		fprintf(stdout,"FAIL\trefresh: couldn't edit %s\n",paths[0]);
+		for(int i=0;i<2;i++) {
+			if(ctx[i]) lomoji_ctx_free(ctx[i]);
+		}
+		g_free(first_cp);
+		return;
+	}
+	g_file_set_contents(paths[0],edited,-1,NULL);
+	corpus_scan(cps,edited);
+	g_free(xml);
+	g_free(edited);
+
+	fresh = lomoji_ctx_new(paths);
+	if(first_cp) lomoji_add_alias(fresh,CHECK_ALIAS,first_cp);
+	lines = corpus_lines(cps);
+
+	for(int i=0;i<2;i++) {
+		if(ctx[i] && lomoji_ctx_refresh(ctx[i])) {
+			failures++;
+			fprintf(stdout,"FAIL\t%s: %s\n",what[i],strerror(errno));
+		}
+		compare(what[i],ctx[i],fresh,lines);
+		if(ctx[i]) lomoji_ctx_free(ctx[i]);
+	}
+	g_ptr_array_free(lines,TRUE);
+	g_free(first_cp);
+	lomoji_ctx_free(fresh);
+}
+
+static void usage(const char *me) {
+	fprintf(stderr,"%s [options] annotations.xml ...:\n",me);
+	fprintf(stderr,"\t-h this message\n");
+	fprintf(stderr,"The files are copied, and the first one is edited to check refreshing.\n");
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	gchar *dir;
+	char **paths;
+	int npaths;
+	GHashTable *cps;
+	GPtrArray *lines;
+	lomoji_ctx_t *fresh;
+
+	while( (opt = getopt(argc,argv,"h")) != -1) {
+		switch(opt) {
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	if(optind >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if( !(dir = g_dir_make_tmp("lomoji-check-XXXXXX",NULL)) ) {
+		fprintf(stderr,"%s: couldn't make a temporary directory.\n",argv[0]);
+		exit(1);
+	}
+
+	/* copy the files, and find the codepoints in them. */
+	npaths = argc - optind;
+	paths = g_new0(char *,npaths+1);
+	cps = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,NULL);
+	for(int i=0;i<npaths;i++) {
+		gchar *xml;
+		gsize len;
+		gchar *name = g_strdup_printf("%d.xml",i);
+
+		paths[i] = g_build_filename(dir,name,NULL);
+		g_free(name);
+		if(!g_file_get_contents(argv[optind+i],&xml,&len,NULL) ||
+			!g_file_set_contents(paths[i],xml,len,NULL)
+		) {
+			fprintf(stderr,"%s: couldn't copy %s\n",argv[0],argv[optind+i]);
+			exit(1);
+		}
+		corpus_scan(cps,xml);
+		g_free(xml);
+	}
+	g_hash_table_add(cps,g_strdup(CHECK_NEW_CP));
+	lines = corpus_lines(cps);
+
+	if( !(fresh = lomoji_ctx_new(paths)) ) {
+		fprintf(stderr,"%s: couldn't set up a context: %s\n",argv[0],strerror(errno));
+		exit(1);
+	}
+
+	check_snapshot(fresh,dir,lines);
+	check_stream(fresh,lines);
+	check_refresh(paths,cps);
+
+	/* clean up your mess. */
+	lomoji_ctx_free(fresh);
+	g_ptr_array_free(lines,TRUE);
+	g_hash_table_destroy(cps);
+	for(int i=0;i<npaths;i++) {
+		unlink(paths[i]);
+	}
+	g_strfreev(paths);
+	rmdir(dir);
+	g_free(dir);
+
+	fprintf(stdout,"%s\n",failures ? "FAILED" : "PASSED");
+	exit(failures ? 1 : 0);
+}
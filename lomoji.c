@@ -28,8 +28,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <glib.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "lomoji.h"
 
 /* local #defines */
@@ -40,6 +47,51 @@
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
+/* true if the utf-8 character at p doesn't end before stop. */
+#define CHAR_CUT(p,stop) ((p) + g_utf8_skip[*(const guchar *)(p)] > (stop))
+
+/* snapshot file identification. Bump SNAP_VERSION whenever the layout of
+ * anything after the stable part of snap_header_t changes. */
+#define SNAP_MAGIC "LOMOJISN"
+#define SNAP_VERSION 6
+#define SNAP_BOM 0x01020304
+#define SNAP_ALIGN(x) (((x) + 7) & ~((gsize)7))
+
+/* the two level codepoint tables. */
+#define CP_PAGE_BITS 8
+#define CP_PAGE_SIZE (1 << CP_PAGE_BITS)
+#define CP_PAGES ((0x10ffff >> CP_PAGE_BITS) + 1)
+#define CP_NONE ((gunichar)-1)
+
+/* the packed alias index. */
+#define ALIAS_BLOCK 16		/* keys per front coded block. */
+#define ALIAS_KEYMAX 256	/* keys this long or longer are stored whole. */
+
+/* context storage. */
+#define ARENA_FIRST 1024	/* an arena's first block, which each one after doubles, */
+#define ARENA_BLOCK 65536	/* up to this. */
+#define OVERLAY_DEPTH 8		/* contexts in a chain of overlays, the bottom one too. */
+#define ARENA_ALIGN(x) (((x) + 7) & ~((gsize)7))
+
+/* the fallback filter memo. */
+#define MEMO_PURE 1		/* a filter that only looks at the grapheme, */
+#define MEMO_NAMED 2		/* or at the context's names and markers too. */
+#define MEMO_SLOTS 256		/* a power of 2. */
+#define MEMO_KEYMAX 32		/* longer graphemes aren't memoized. */
+#define MEMO_VALMAX 80		/* nor are longer outputs. */
+
+/* compiled filter lists. */
+#define PIPE_HIT (-1)		/* what pipeline_run() returns for a lookup. */
+#define COUNTED_FILTERS 16	/* custom filters with a counted form. */
+
+/* streams. */
+#define STREAM_CARRYMAX 256	/* held back text this long is let go. */
+
+/* runtime statistics, unless built with -DLOMOJI_NO_STATS. */
+#define STATS_SHARDS 32		/* threads with a shard to themselves, <= 32. */
+#define STATS_LINE 64		/* cache line size, to keep shards apart. */
+#define STATS_SAMPLE 16		/* time one call in this many, a power of 2. */
+
 #ifndef SHARE_PREFIX
 #define SHARE_PREFIX "/usr/local/share"
 #endif
@@ -52,9 +104,351 @@ struct lomoji_ctx_s {
 	char *tts_prefix;		/* marker for start of ascii name */
 	char *tts_suffix;		/* marker for end of ascii name */
 	char *unknown;			/* 'unknown codepoint' substitution */
-	GHashTable *cp_tts;		/*codepoint to tts string.*/
-	GHashTable *cp_equiv;	/*codepoint to single ascii char.*/
+	struct arena_s *arena;		/* the tables' strings, NULL once frozen. */
+	struct cp_table_s *cp_tts;	/*codepoint to tts string.*/
+	struct cp_table_s *cp_equiv;	/*codepoint to single ascii char.*/
 	GTree *alias_cp;		/*alias to codepoint. */
+	struct alias_index_s *alias_ix;	/* alias_cp, packed once loading finishes. */
+	gint alias_pending;		/* sources from alias_from on aren't in the aliases yet. */
+	guint alias_from;
+	GMutex alias_lock;		/* for putting them in. */
+	GPtrArray *sources;		/* lomoji_source_t's, in the order merged. */
+	GHashTable *added;		/* lomoji_add_alias() keys to added_alias_t's, or NULL. */
+	struct lomoji_snap_s *snap;	/* snapshot or frozen image, replaces the tables. */
+	gint refs;			/* references, for published contexts. */
+	gint published;			/* read-only since lomoji_ctx_publish(). */
+	struct cache_s *cache;		/* recent whole-string translations, or NULL. */
+	struct memo_s *memo;		/* fallback filter outputs, made when needed. */
+	GPtrArray *pipes;		/* compiled filter lists, or NULL. */
+	struct stats_s *stats;		/* runtime statistics, made when needed. */
+	struct lomoji_ctx_s *base;	/* an overlay's base, whose tables it shares. */
+	gint overlays;			/* overlays sharing this one's tables. */
+	gint refreshable;		/* keep what each source held, for refreshing. */
+};
+
+/* a set of contexts for different locales.  Each locale is an overlay on the
+ * one it falls back to, and the ones at the end of the chain are overlays on
+ * root, which holds the equivalents, regional indicators and oneoffs that all
+ * of them share. */
+struct lomoji_pool_s {
+	lomoji_ctx_t *root;
+	GHashTable *locales;	/* locale name to its lomoji_ctx_t. */
+	gchar *fallback;	/* where a locale with no parent in the pool goes, or NULL. */
+};
+
+/* an annotations file that was merged into a context, and what it looked like
+ * at the time.  size is -1 if the file did not exist.  What the file put into
+ * the context is recorded too, so that lomoji_ctx_refresh() can redo just
+ * that file.  The tables are NULL when that wasn't recorded (for sources read
+ * from a snapshot, or after freezing), or once they're merged into a context
+ * that isn't refreshable.  Splitting up the aliases is left until
+ * something needs them, so until then the alias tables are empty, and the
+ * names and aliases are kept as they came in aliases, each one a kind byte
+ * ('=' for a name, '|' for an alias list), the cp, and the text, with the
+ * strings nul-terminated. */
+typedef struct {
+	char *path;
+	gint64 mtime;
+	gint64 size;
+	GHashTable *tts;	/* cp to name, the last one in the file. */
+	GHashTable *alias_set;	/* alias to cp, replacing any from before. */
+	GHashTable *alias_add;	/* alias to cp, unless there was one before. */
+	GString *aliases;	/* the file's names and aliases, until they're needed. */
+	struct arena_s *arena;	/* the context's, where the tables' strings are. */
+} lomoji_source_t;
+
+/* an alias put in with lomoji_add_alias(), and how many sources had been
+ * merged when it was, so that rebuilding the aliases can put it back in the
+ * same place among them. */
+typedef struct {
+	guint at;
+	gchar *cp;
+} added_alias_t;
+
+/* Snapshot file layout.  All offsets are from the start of the file, so the
+ * file can be mapped anywhere.  Strings are stored nul-terminated in a shared
+ * pool, and each table is an array of snap_entry_t.  The alias table is sorted
+ * by strcmp() order of the keys.  The codepoint tables hold multi-codepoint
+ * sequences in the slot order of a minimal perfect hash, described by a
+ * snap_mph_t, and single codepoints in a snap_cpmap_t.  The sequences are
+ * also in a byte trie, in a snap_trie_t.  The aliases are in a second table,
+ * in minimal perfect hash order, for looking up whole names.  The file ends
+ * with a nul, so that any string offset inside it is terminated inside it. */
+
+/* a node in a byte trie of multi-codepoint sequences.  Node 0 is the root, so
+ * a child or sibling of 0 means there isn't one.  Siblings are in ascending
+ * byte order.  accept is set on the last byte of a key.  The same nodes are
+ * used in live contexts and in snapshots. */
+typedef struct {
+	guint32 child;
+	guint32 sibling;
+	guint8 byte;
+	guint8 accept;
+	guint16 pad;
+} trie_node_t;
+
+typedef struct {
+	guint32 nodes;		/* trie_node_t[count] */
+	guint32 count;
+} snap_trie_t;
+
+/* the single codepoint part of a codepoint table, as a two level array.  An
+ * empty page in the directory points at page 0, which is all zeros. */
+typedef struct {
+	guint32 dir;		/* guint16[CP_PAGES] page numbers. */
+	guint32 pages;		/* guint32[npages][CP_PAGE_SIZE] value offsets, or 0. */
+	guint32 npages;
+	guint32 count;
+} snap_cpmap_t;
+
+/* a minimal perfect hash over one of the tables. */
+typedef struct {
+	guint32 seed;
+	guint32 nbuckets;
+	guint32 buckets;	/* guint32[nbuckets*2] displacements. */
+	guint32 pad;
+} snap_mph_t;
+
+typedef struct {
+	/* stable part, readable by any version. */
+	char magic[8];
+	guint32 bom;		/* SNAP_BOM, in the writer's byte order. */
+	guint32 version;	/* SNAP_VERSION */
+	guint32 size;		/* total size of the file. */
+	guint32 nsources;
+	guint32 sources;	/* snap_source_t[nsources] */
+	guint32 prefix;		/* param strings. */
+	guint32 suffix;
+	guint32 unknown;
+	/* version specific part. */
+	guint32 tts, ntts;	/* snap_entry_t[ntts] codepoint to tts. */
+	guint32 equiv, nequiv;	/* snap_entry_t[nequiv] codepoint to equiv. */
+	guint32 alias, nalias;	/* snap_entry_t[nalias] alias to codepoint. */
+	snap_mph_t tts_mph;
+	snap_mph_t equiv_mph;
+	snap_cpmap_t tts_cp;
+	snap_cpmap_t equiv_cp;
+	snap_trie_t tts_trie;
+	snap_trie_t equiv_trie;
+	guint32 exact, nexact;	/* snap_entry_t[nexact] alias to codepoint. */
+	snap_mph_t exact_mph;
+	guint32 check;		/* snap_header_check() of the header. */
+	guint32 pad;
+} snap_header_t;
+
+typedef struct {
+	guint32 path;
+	guint32 pad;
+	gint64 mtime;
+	gint64 size;
+} snap_source_t;
+
+typedef struct {
+	guint32 key;
+	guint32 keylen;
+	guint32 val;
+	guint32 vallen;
+} snap_entry_t;
+
+/* a snapshot image, either mapped from a file or built by freezing. */
+struct lomoji_snap_s {
+	const char *base;
+	gsize size;
+	gboolean mapped;	/* munmap() it, rather than g_free(). */
+	gint refs;		/* contexts reading it. */
+	const snap_header_t *hdr;
+	const snap_entry_t *tts;
+	const snap_entry_t *equiv;
+	const snap_entry_t *alias;
+	const guint32 *tts_disp;
+	const guint32 *equiv_disp;
+	const guint16 *tts_dir;
+	const guint32 *tts_pages;
+	const guint16 *equiv_dir;
+	const guint32 *equiv_pages;
+	const trie_node_t *tts_trie;
+	const trie_node_t *equiv_trie;
+	const snap_entry_t *exact;
+	const guint32 *exact_disp;
+};
+
+/* the alias index of a live context once loading has finished, in place of
+ * the alias_cp tree.  Keys are front coded in blocks of ALIAS_BLOCK.  The
+ * first key of a block is stored whole, and each key after it as one byte
+ * saying how much of the key before it is shared, then the rest of it.  Keys
+ * are nul-terminated.  A lookup is a binary search over the first keys of the
+ * blocks, then a scan along adjacent memory.  Values are offsets into a pool
+ * of codepoint strings, which many aliases share. */
+typedef struct alias_index_s {
+	gchar *keys;
+	guint32 *block;		/* offset in keys of each block's first key. */
+	gchar *vals;
+	guint32 *val;		/* offset in vals of each entry's value. */
+	guint32 n;
+	guint32 nblocks;
+} alias_index_t;
+
+/* alias_walk walks one context's alias index in sorted order, whether it
+ * lives in the alias_cp tree, the packed index, or in a snapshot. */
+typedef struct {
+	GTreeNode *node;
+	const struct lomoji_snap_s *snap;
+	const snap_entry_t *e;
+	const snap_entry_t *end;
+	const alias_index_t *ix;
+	guint32 i;		/* entry in ix. */
+	const gchar *next;	/* encoded key of entry i+1. */
+	const gchar *key;	/* decoded key of entry i. */
+	gchar buf[ALIAS_KEYMAX];
+} alias_walk;
+
+/* alias_cursor walks all of a context's aliases.  An overlay's are its own
+ * and those of every context under it together, so it walks them all, and
+ * the nearest one wins where they have the same key. */
+typedef struct {
+	alias_walk w[OVERLAY_DEPTH];	/* the context's own, then its base's, and so on. */
+	int n;			/* how many of w are in use. */
+	int at;			/* which one is on the current key. */
+} alias_cursor;
+
+/* a counted string.  The codepoint tables are keyed by these, so that a
+ * grapheme can be looked up where it sits in the source string without
+ * copying it out and nul-terminating it first.  Keys stored in a table are
+ * interned in the context's arena, with the (nul-terminated) text right after
+ * the struct. */
+typedef struct {
+	const gchar *str;
+	gsize len;
+} lomoji_slice_t;
+
+/* a context's table storage.  Every key and value string is interned, so a
+ * codepoint string that is the value of a dozen aliases and the key of a name
+ * is only stored once, and they are all carved out of a few large blocks that
+ * are let go of together.  Nothing is freed on its own, so strings that a
+ * table stops using (when lomoji_ctx_refresh() replaces a name, say) stay
+ * until the arena goes. */
+typedef struct arena_s {
+	GPtrArray *blocks;
+	gchar *at;		/* the free part of the current block. */
+	gsize left;
+	gsize grow;		/* the size of the current block. */
+	GHashTable *strings;	/* the interned lomoji_slice_t's. */
+	const struct arena_s *under;	/* an overlay's base's, which it looks in first. */
+} arena_t;
+
+/* a codepoint table.  Graphemes that are a single codepoint are kept in a two
+ * level array indexed by the codepoint itself, so that looking one up is two
+ * array loads.  Only multi-codepoint sequences go in the hash, and in the
+ * trie that is used to find where they start and end. */
+typedef struct cp_table_s {
+	const gchar **page[CP_PAGES];	/* CP_PAGE_SIZE values each, or NULL. */
+	guint singles;
+	GHashTable *seq;		/* keyed by lomoji_slice_t's. */
+	GArray *trie;			/* trie_node_t's, of the keys in seq. */
+	arena_t *arena;			/* the keys, values and pages. */
+} cp_table_t;
+
+/* what a translation in the cache is looked up by: the bytes that were
+ * translated, which filter list did it, and in which direction. */
+typedef struct {
+	guint64 hash;
+	lomoji_filter **filters;
+	gint dir;		/* CACHE_TO or CACHE_FROM. */
+	gsize len;
+	const gchar *in;
+} cache_key_t;
+
+#define CACHE_TO 0
+#define CACHE_FROM 1
+
+/* a remembered translation.  The input and output bytes follow the struct,
+ * in the same allocation. */
+typedef struct {
+	cache_key_t key;	/* first, so the entry is its own hash key. */
+	gsize outlen;
+	const gchar *out;
+	gint ref;		/* used since the clock hand last came by. */
+	gchar bytes[];
+} cache_entry_t;
+
+/* a context's whole-string translation cache.  Entries are found through the
+ * hash table, and evicted in CLOCK order by a hand going around the ring, so
+ * that a hit only has to set the entry's ref.  bytes counts the entries and
+ * what they hold against the budget.  Translating threads share the cache of
+ * a published context, so it has its own lock. */
+typedef struct cache_s {
+	GMutex lock;
+	GHashTable *map;	/* cache_key_t's to cache_entry_t's. */
+	GPtrArray *ring;	/* the same entries. */
+	guint hand;
+	gsize budget;
+	gsize bytes;
+	guint64 hits;
+	guint64 misses;
+} cache_t;
+
+/* a filter list compiled against a context by lomoji_pipeline_compile().
+ * The table's values are the length of the output in a byte, then the
+ * output. */
+typedef struct {
+	lomoji_filter **filters;
+	cp_table_t *table;
+	arena_t *arena;
+} pipeline_t;
+
+/* what a fallback filter made of a grapheme the last time. */
+typedef struct {
+	guint32 hash;
+	guint8 which;		/* index in builtin_filters, plus 1.  0 if unused. */
+	guint8 ret;		/* what the filter returned. */
+	guint8 keylen;
+	guint8 vallen;
+	gchar key[MEMO_KEYMAX];
+	gchar val[MEMO_VALMAX];
+} memo_slot_t;
+
+/* a small direct mapped memo of the fallback filters, which are slow for
+ * what they do (iconv, formatting each codepoint), and tend to see the same
+ * odd graphemes over and over. */
+typedef struct memo_s {
+	GMutex lock;
+	memo_slot_t slot[MEMO_SLOTS];
+} memo_t;
+
+/* what one call counted, to go into the context's statistics all at once at
+ * the end of the call. */
+typedef struct {
+	guint64 t0;			/* when the call started, or 0 if untimed. */
+	guint64 ascii_bytes;
+	guint64 filtered[LOMOJI_STAT_MAX];
+} stats_tally_t;
+
+#ifndef LOMOJI_NO_STATS
+/* one thread's share of a context's statistics.  A thread that has claimed
+ * a slot is the only one that writes to that shard, so it counts without
+ * atomic adds, and on its own cache lines.  Threads beyond STATS_SHARDS all
+ * share one more shard, with atomic adds. */
+typedef struct {
+	lomoji_stats_t s;
+} __attribute__((aligned(STATS_LINE))) stats_shard_t;
+G_STATIC_ASSERT(sizeof(stats_shard_t) % STATS_LINE == 0);
+
+typedef struct stats_s {
+	gint refs;			/* contexts counting into it. */
+	gpointer mem;
+	stats_shard_t *shard;		/* STATS_SHARDS + 1 of them, in mem, aligned. */
+	GMutex lock;			/* for base. */
+	lomoji_stats_t base;		/* the totals at the last reset. */
+} stats_t;
+#endif
+
+/* a translation in progress.  carry is the text at the end of the last
+ * chunk that can't be translated until more of it turns up. */
+struct lomoji_stream_s {
+	lomoji_ctx_t *ctx;
+	lomoji_filter **filters;
+	int from;			/* from ascii, rather than to. */
+	GString *carry;
 };
 
 /* annotations accumulator structure, used by the XML parser. */
@@ -62,7 +456,7 @@ struct ann_acc {
 	gchar *cp;
 	gchar *text;
 	int tts;
-	lomoji_ctx_t *ctx;
+	lomoji_source_t *src;		/* record into this. */
 };
 
 /* a struct associating an ascii character with a utf string. */
@@ -82,7 +476,9 @@ static void ann_parser_characters(GMarkupParseContext * context, const gchar * t
 static void ann_parser_passthrough(GMarkupParseContext * context, const gchar * passthrough_text, gsize text_len,
     gpointer user_data, GError ** error);
 static void ann_parser_error(GMarkupParseContext * context, GError * error, gpointer user_data);
-struct ann_acc *ann_acc_new(lomoji_ctx_t *ctx);
+struct ann_acc *ann_acc_new(lomoji_source_t *src);
+static int ann_parse_file(lomoji_source_t *src);
+static int ann_parse_sources(lomoji_ctx_t *ctx, guint from);
 static void ann_acc_clear(struct ann_acc *acc);
 static void ann_acc_free(struct ann_acc *acc);
 static gint treecompare(gconstpointer a, gconstpointer b, gpointer user_data);
@@ -91,7 +487,77 @@ static gint treecompare(gconstpointer a, gconstpointer b, gpointer user_data);
 int lomoji_add_equiv(lomoji_ctx_t *ctx, lomoji_equiv_t *source);
 int lomoji_add_regional(lomoji_ctx_t *ctx);
 void lomoji_add_oneoffs(lomoji_ctx_t *ctx);
-gchar *keypart_dup(lomoji_ctx_t *ctx, char *in);
+static void oneoffs_insert(lomoji_ctx_t *ctx);
+static const gchar *oneoffs_tts(const gchar *cp);
+static gchar *oneoffs_alias(const gchar *alias);
+
+/* counted string keys for the codepoint tables. */
+static arena_t *arena_new(const arena_t *under);
+static void arena_free(arena_t *a);
+static gpointer arena_alloc(arena_t *a, gsize size);
+static const lomoji_slice_t *arena_intern(arena_t *a, const gchar *str, gsize len);
+static const gchar *arena_strdup(arena_t *a, const gchar *str);
+static const gchar *arena_take(arena_t *a, gchar *str);
+static void arena_adopt(arena_t *into, arena_t *from);
+static guint slice_hash(gconstpointer key);
+static gboolean slice_equal(gconstpointer a, gconstpointer b);
+static gunichar cp_decode(const gchar *s, gsize len);
+static cp_table_t *cp_table_new(arena_t *arena);
+static void cp_table_free(cp_table_t *t);
+static cp_table_t *cp_table_copy(cp_table_t *t, arena_t *arena);
+static void cp_table_insert(cp_table_t *t, const gchar *key, gsize len, const gchar *value);
+static void cp_table_remove(cp_table_t *t, const gchar *key, gsize len);
+static const gchar *cp_table_lookup(cp_table_t *t, const gchar *key, gsize len, gunichar c);
+static void trie_insert(GArray *trie, const gchar *key, gsize len);
+static void trie_unaccept(GArray *trie, const gchar *key, gsize len);
+static gsize trie_match(const trie_node_t *nodes, guint32 n, const gchar *p, const gchar *stop);
+static gsize ctx_match_tts(lomoji_ctx_t *ctx, const gchar *p, const gchar *stop);
+static gsize ctx_match(lomoji_ctx_t *ctx, const gchar *p, const gchar *stop);
+
+/* table access that works on both live and snapshot contexts. */
+static const gchar *ctx_lookup_tts(lomoji_ctx_t *ctx, const gchar *cp, gsize len);
+static const gchar *ctx_lookup_equiv(lomoji_ctx_t *ctx, const gchar *cp, gsize len);
+static const gchar *ctx_lookup_alias(lomoji_ctx_t *ctx, const gchar *name, gsize len);
+static int alias_seek(lomoji_ctx_t *ctx, alias_cursor *c, const gchar *key);
+static void alias_next(alias_cursor *c);
+static const gchar *alias_key(alias_cursor *c);
+static const gchar *alias_value(alias_cursor *c);
+static void alias_walk_seek(lomoji_ctx_t *ctx, alias_walk *w, const gchar *key);
+static void alias_walk_next(alias_walk *w);
+static const gchar *alias_walk_key(alias_walk *w);
+static const gchar *alias_walk_value(alias_walk *w);
+static void alias_ix_decode(alias_walk *w);
+static int alias_ix_seek(const alias_index_t *ix, alias_walk *w, const gchar *key);
+static const gchar *alias_ix_lookup(const alias_index_t *ix, const gchar *name, gsize len);
+static void alias_pack(lomoji_ctx_t *ctx);
+static void alias_unpack(lomoji_ctx_t *ctx);
+static void alias_ix_free(alias_index_t *ix);
+static void ctx_thaw(lomoji_ctx_t *ctx);
+static void source_stat(const char *path, gint64 *mtime, gint64 *size);
+static lomoji_source_t *ctx_add_source(lomoji_ctx_t *ctx, const char *path);
+static void source_record(lomoji_source_t *src, struct arena_s *arena);
+static void source_forget(lomoji_source_t *src);
+static void source_merge(lomoji_ctx_t *ctx, lomoji_source_t *src);
+static void source_log(lomoji_source_t *src, gchar kind, const gchar *cp, const gchar *text);
+static void source_expand(lomoji_source_t *src);
+static void alias_merge(lomoji_ctx_t *ctx);
+static inline void alias_ready(lomoji_ctx_t *ctx);
+static void lomoji_source_free(gpointer p);
+static void snap_unmap(struct lomoji_snap_s *snap);
+static void snap_attach(struct lomoji_snap_s *s);
+static guint64 mph_hash(const gchar *key, gsize len, guint32 seed);
+static guint64 cache_hash(const gchar *s, gsize len);
+static void cache_clear(cache_t *c);
+static void cache_free(cache_t *c);
+static void memo_clear(memo_t *m);
+static void memo_free(memo_t *m);
+static void ctx_changed(lomoji_ctx_t *ctx);
+static cp_table_t *ctx_own_table(lomoji_ctx_t *ctx, int equiv);
+static void ctx_destroy(lomoji_ctx_t *ctx);
+static void ctx_unref(lomoji_ctx_t *ctx);
+static void stats_free(struct stats_s *st);
+static struct stats_s *stats_share(struct stats_s *st);
+static inline guint32 mph_slot(const snap_mph_t *mph, const guint32 *disp, guint32 n, guint64 h);
 
 /*---- exported local variable declarations ----*/
 
@@ -109,6 +575,17 @@ char *lomoji_filepath_example[] = {
 /* a shared context for the 'basic' functions to use. */
 lomoji_ctx_t *lomoji_default_ctx = NULL;
 
+/* Publishing lomoji_default_ctx.  Readers pin it with lomoji_ctx_acquire()
+ * without taking a lock.  They count themselves into pub_inflight[phase] just
+ * long enough to load the pointer and take a reference.  A publisher swaps the
+ * pointer, flips the phase, and waits for the old phase's count to drain,
+ * after which no reader can still be about to take a reference to the old
+ * context.  Readers arriving meanwhile count into the new phase, so the wait
+ * can't be starved.  Publishers are serialized by pub_lock. */
+static GMutex pub_lock;
+static gint pub_phase = 0;
+static gint pub_inflight[2] = { 0, 0 };
+
 /* exported filter lists. */
 lomoji_filter *lomoji_none[] = {
 	NULL
@@ -154,6 +631,31 @@ lomoji_filter *lomoji_nameiconv[] = {
 	NULL
 };
 
+/* custom filters, and the counted forms registered for them with
+ * lomoji_filter_counted().  An entry is filled in before the count that
+ * covers it goes up, so a reader never sees half of one. */
+static struct {
+	lomoji_filter *f;
+	lomoji_filter_n *fn;
+} counted_filters[COUNTED_FILTERS];
+static gint counted_count = 0;
+
+/* the builtin filters, and their counted forms that the translators call
+ * directly. */
+static const struct {
+	lomoji_filter *f;
+	lomoji_filter_n *fn;
+	int memo;		/* slow enough for the memo to be worth it, and what
+				 * its output depends on. */
+} builtin_filters[] = {
+	{ filter_toname, filter_toname_n, 0 },
+	{ filter_equiv, filter_equiv_n, 0 },
+	{ filter_decompose, filter_decompose_n, MEMO_NAMED },
+	{ filter_unknown, filter_unknown_n, 0 },
+	{ filter_fromname, filter_fromname_n, 0 },
+	{ filter_uplus, filter_uplus_n, MEMO_PURE },
+	{ filter_iconv, filter_iconv_n, MEMO_PURE }
+};
 
 /*---- local variable declarations ----*/
 
@@ -247,16 +749,28 @@ lomoji_equiv_t default_equiv[] = {
 
 /* for most of these functions, see the lomoji.h file for API documentation. */
 
+/* a context with the given parameters, one reference, and nothing else.  The
+ * tables, or a snapshot in their place, are up to the caller. */
+static lomoji_ctx_t *ctx_alloc(const gchar *prefix, const gchar *suffix, const gchar *unknown) {
+	lomoji_ctx_t *new = g_new0(lomoji_ctx_t,1);
+
+	new->tts_prefix = g_strdup(prefix);
+	new->tts_suffix = g_strdup(suffix);
+	new->unknown = g_strdup(unknown);
+	g_mutex_init(&new->alias_lock);
+	new->sources = g_ptr_array_new_with_free_func(lomoji_source_free);
+	new->refs = 1;
+	return(new);
+}
+
 lomoji_ctx_t *lomoji_ctx_new(char **annotations) {
 	lomoji_ctx_t *new;
 
-	new = (lomoji_ctx_t*)malloc(sizeof(lomoji_ctx_t));
-	new->tts_prefix = g_strdup(DEFAULT_TTS_PREFIX);
-	new->tts_suffix = g_strdup(DEFAULT_TTS_SUFFIX);
-	new->unknown = g_strdup(DEFAULT_UNKNOWN);
-	new->cp_tts = g_hash_table_new_full(g_str_hash, g_str_equal,g_free,g_free);
-	new->cp_equiv = g_hash_table_new_full(g_str_hash, g_str_equal,g_free,g_free);
-	new->alias_cp = g_tree_new_full(treecompare,NULL,g_free,g_free);
+	new = ctx_alloc(DEFAULT_TTS_PREFIX,DEFAULT_TTS_SUFFIX,DEFAULT_UNKNOWN);
+	new->arena = arena_new(NULL);
+	new->cp_tts = cp_table_new(new->arena);
+	new->cp_equiv = cp_table_new(new->arena);
+	new->alias_cp = g_tree_new_full(treecompare,NULL,NULL,NULL);
 
 	lomoji_add_equiv(new,NULL);
 	lomoji_add_regional(new);
@@ -269,18 +783,247 @@ lomoji_ctx_t *lomoji_ctx_new(char **annotations) {
 	return(new);
 }
 
+lomoji_ctx_t *lomoji_ctx_new_refreshable(char **annotations) {
+	lomoji_ctx_t *new = lomoji_ctx_new(NULL);
+
+	new->refreshable = 1;
+	if(annotations) {
+		lomoji_add_annotations(new,annotations);
+	}
+
+	return(new);
+}
+
+lomoji_ctx_t *lomoji_ctx_derive(lomoji_ctx_t *base) {
+	lomoji_ctx_t *new;
+	int depth = 1;
+
+	if(!base) {
+		errno = EPERM;
+		return(NULL);
+	}
+	/* the alias cursor has a walk for each context in the chain. */
+	for(lomoji_ctx_t *t = base;t;t = t->base) {
+		if(++depth > OVERLAY_DEPTH) {
+			errno = EINVAL;
+			return(NULL);
+		}
+	}
+	/* base's strings and tables are read from here on, so finish off its
+	 * aliases now, while nothing else is. */
+	alias_ready(base);
+
+	new = ctx_alloc(base->tts_prefix,base->tts_suffix,base->unknown);
+	/* the tables are made as things are put in them.  Strings that base
+	 * has already (the codepoints, mostly) aren't copied, unless it's frozen
+	 * and has no arena. */
+	new->arena = arena_new(base->arena);
+	new->refreshable = base->refreshable;
+
+	/* base stays, and stays as it is, for as long as there's an overlay on
+	 * it. */
+	g_atomic_int_inc(&base->refs);
+	g_atomic_int_inc(&base->overlays);
+	new->base = base;
+
+	return(new);
+}
+
 void lomoji_ctx_free(lomoji_ctx_t *p) {
-	if(!p) return;
+	if(p) ctx_unref(p);
+}
 
+/* free a context that nothing refers to any more. */
+static void ctx_destroy(lomoji_ctx_t *p) {
 	if(p->tts_prefix) g_free(p->tts_prefix);
 	if(p->tts_suffix) g_free(p->tts_suffix);
 	if(p->unknown) g_free(p->unknown);
-	if(p->cp_tts) g_hash_table_destroy(p->cp_tts);
-	if(p->cp_equiv) g_hash_table_destroy(p->cp_equiv);
+	if(p->cp_tts) cp_table_free(p->cp_tts);
+	if(p->cp_equiv) cp_table_free(p->cp_equiv);
 	if(p->alias_cp) g_tree_destroy(p->alias_cp);
+	if(p->alias_ix) alias_ix_free(p->alias_ix);
+	g_mutex_clear(&p->alias_lock);
+	if(p->sources) g_ptr_array_free(p->sources,TRUE);
+	if(p->added) g_hash_table_destroy(p->added);
+	if(p->snap) snap_unmap(p->snap);
+	if(p->cache) cache_free(p->cache);
+	if(p->memo) memo_free(p->memo);
+	if(p->pipes) g_ptr_array_free(p->pipes,TRUE);
+	if(p->stats) stats_free(p->stats);
+	/* all of the tables' strings, in one go. */
+	if(p->arena) arena_free(p->arena);
+	if(p->base) {
+		g_atomic_int_add(&p->base->overlays,-1);
+		ctx_unref(p->base);
+	}
+	g_free(p);
 	return;
 }
 
+/* drop a reference, and free the context with the last one. */
+static void ctx_unref(lomoji_ctx_t *ctx) {
+	if(g_atomic_int_dec_and_test(&ctx->refs)) {
+		ctx_destroy(ctx);
+	}
+}
+
+/* locale names are kept with '_' between the parts, as CLDR names its files,
+ * so "de-CH" is the same locale as "de_CH". */
+static gchar *pool_locale(const char *locale) {
+	return(g_strdelimit(g_strdup(locale),"-",'_'));
+}
+
+/* the context locale falls back to: the nearest of its parents that's in the
+ * pool (de for de_CH), or else the pool's fallback locale, or else root. */
+static lomoji_ctx_t *pool_parent(lomoji_pool_t *pool, const gchar *locale) {
+	gchar *name = g_strdup(locale), *cut;
+	lomoji_ctx_t *ctx = NULL;
+
+	while(!ctx && (cut = strrchr(name,'_'))) {
+		*cut = '\0';
+		ctx = g_hash_table_lookup(pool->locales,name);
+	}
+	g_free(name);
+
+	if(!ctx && pool->fallback && strcmp(locale,pool->fallback)) {
+		ctx = g_hash_table_lookup(pool->locales,pool->fallback);
+	}
+	return(ctx ? ctx : pool->root);
+}
+
+lomoji_pool_t *lomoji_pool_new(const char *fallback) {
+	lomoji_pool_t *new;
+
+	new = g_new0(lomoji_pool_t,1);
+	new->root = lomoji_ctx_new(NULL);
+	new->locales = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,(GDestroyNotify)lomoji_ctx_free);
+	new->fallback = fallback ? pool_locale(fallback) : NULL;
+	return(new);
+}
+
+int lomoji_pool_add(lomoji_pool_t *pool, const char *locale, char **annotations) {
+	lomoji_ctx_t *ctx, *parent;
+	gchar *name;
+	int ret;
+
+	if(!pool) return((errno = EPERM));
+	if(!locale || !*locale || !annotations) return((errno = EINVAL));
+
+	name = pool_locale(locale);
+	if(g_hash_table_contains(pool->locales,name)) {
+		g_free(name);
+		return((errno = EEXIST));
+	}
+
+	/* what it has in common with its parent, it shares. */
+	parent = pool_parent(pool,name);
+	if( !(ctx = lomoji_ctx_derive(parent)) ) {
+		ret = errno;
+		g_free(name);
+		return(ret);
+	}
+	if( (ret = lomoji_add_annotations(ctx,annotations)) ) {
+		lomoji_ctx_free(ctx);
+		g_free(name);
+		return((errno = ret));
+	}
+
+	/* the parent can't be refreshed while anything falls back to it, so
+	 * what its files held needn't be kept.  A refresh after that starts
+	 * over, as it does on a frozen context. */
+	for(guint i=0;i<parent->sources->len;i++) {
+		source_forget(g_ptr_array_index(parent->sources,i));
+	}
+
+	g_hash_table_insert(pool->locales,name,ctx);
+	return(0);
+}
+
+lomoji_ctx_t *lomoji_pool_get(lomoji_pool_t *pool, const char *locale) {
+	lomoji_ctx_t *ctx;
+	gchar *name;
+
+	if(!pool) {
+		errno = EPERM;
+		return(NULL);
+	}
+
+	name = pool_locale(locale ? locale : "");
+	if( !(ctx = g_hash_table_lookup(pool->locales,name)) ) {
+		ctx = pool_parent(pool,name);
+	}
+	g_free(name);
+	return(ctx);
+}
+
+void lomoji_pool_free(lomoji_pool_t *pool) {
+	if(!pool) return;
+
+	/* a parent locale goes with the last of its children, and root with
+	 * the last locale. */
+	g_hash_table_destroy(pool->locales);
+	lomoji_ctx_free(pool->root);
+	if(pool->fallback) g_free(pool->fallback);
+	g_free(pool);
+}
+
+int lomoji_ctx_publish(lomoji_ctx_t *ctx) {
+	lomoji_ctx_t *old;
+	gint phase;
+	int ret;
+
+	if(ctx) {
+		/* it's already out there. */
+		if(ctx->published) return((errno = EBUSY));
+
+		/* readers get a context that can't change under them. */
+		if( (ret = lomoji_ctx_freeze(ctx)) ) {
+			return(ret);
+		}
+		ctx->published = 1;
+	}
+
+	g_mutex_lock(&pub_lock);
+	old = g_atomic_pointer_get(&lomoji_default_ctx);
+	g_atomic_pointer_set(&lomoji_default_ctx,ctx);
+
+	phase = g_atomic_int_get(&pub_phase);
+	g_atomic_int_set(&pub_phase,phase ^ 1);
+	while(g_atomic_int_get(&pub_inflight[phase])) {
+		g_thread_yield();
+	}
+	g_mutex_unlock(&pub_lock);
+
+	/* the old one goes when its last reader lets go of it.  Publishing the
+	 * default that lomoji_init() put in place keeps the one reference. */
+	if(old && old != ctx) ctx_unref(old);
+	return(0);
+}
+
+lomoji_ctx_t *lomoji_ctx_acquire(void) {
+	lomoji_ctx_t *ctx;
+	gint phase;
+
+	/* count in under the current phase.  If a publisher flipped it in the
+	 * meantime, it may not wait for us, so count in again. */
+	for(;;) {
+		phase = g_atomic_int_get(&pub_phase);
+		g_atomic_int_inc(&pub_inflight[phase]);
+		if(g_atomic_int_get(&pub_phase) == phase) break;
+		g_atomic_int_add(&pub_inflight[phase],-1);
+	}
+
+	if( (ctx = g_atomic_pointer_get(&lomoji_default_ctx)) ) {
+		g_atomic_int_inc(&ctx->refs);
+	}
+	g_atomic_int_add(&pub_inflight[phase],-1);
+	return(ctx);
+}
+
+void lomoji_ctx_release(lomoji_ctx_t *ctx) {
+	if(ctx) ctx_unref(ctx);
+}
+
 gint treecompare(gconstpointer a, gconstpointer b, gpointer user_data) {
 	return(strcmp(a,b));
 }
@@ -336,30 +1079,21 @@ static void ann_parser_end_element(
 				if(*c==':') *c='_';  /* colons too. */
 			}
 			/* 
-			if((g_hash_table_contains(acc->ctx->cp_tts,acc->cp))) {
+			if((cp_table_lookup(acc->ctx->cp_tts,acc->cp,strlen(acc->cp),cp_decode(acc->cp,strlen(acc->cp))))) {
 				fprintf(stderr,"overriding duplicate tts with %s -> %s\n",acc->cp,acc->text);
 			}
 			*/
-			g_hash_table_insert(acc->ctx->cp_tts,g_strdup(acc->cp),g_str_to_ascii(acc->text,NULL));
-			g_tree_insert(acc->ctx->alias_cp,g_str_to_ascii(acc->text,NULL),g_strdup(acc->cp));
+			gchar *ascii = g_str_to_ascii(acc->text,NULL);
+			arena_t *a = acc->src->arena;
+			const gchar *name = arena_strdup(a,ascii);
+			const gchar *cp = arena_strdup(a,acc->cp);
+			g_hash_table_insert(acc->src->tts,(gpointer)cp,(gpointer)name);
+			source_log(acc->src,'=',cp,name);
+			g_free(ascii);
 		} else if (acc->text) {
-			/* this is an alias entry. */
-			gchar **aliases;
-			aliases = g_strsplit(acc->text,"|",-1);
-			for(char **a = aliases; a && *a; a++) {
-				char *alias = g_strdup(g_strstrip(*a));
-				for(gchar *c=alias;*c;c++) {
-					if(*c==' ') *c='_';
-					if(*c==':') *c='_';  /* colons too. */
-				}
-				if(g_tree_lookup(acc->ctx->alias_cp,alias) == NULL) {
-					g_tree_insert(acc->ctx->alias_cp,g_str_to_ascii(alias,NULL),g_strdup(acc->cp));
-				} else {
-					//fprintf(stderr,"skipping duplicate alias %s -> %s\n",alias,acc->cp);
-				}
-				g_free(alias);
-			}
-			g_strfreev(aliases);
+			/* this is an alias entry, which is split up later, if the
+			 * aliases are ever wanted. */
+			source_log(acc->src,'|',acc->cp,acc->text);
 		}
 
 		/* reset the accumulator. */
@@ -420,14 +1154,14 @@ void ann_acc_clear(struct ann_acc *acc) {
 	acc->tts = 0;
 }
 
-struct ann_acc *ann_acc_new(lomoji_ctx_t *ctx) {
+struct ann_acc *ann_acc_new(lomoji_source_t *src) {
 	
 	struct ann_acc *new;
 
 	new = (struct ann_acc *)malloc(sizeof(struct ann_acc));
 	new->cp = new->text = NULL;
 	new->tts = 0;
-	new->ctx = ctx;
+	new->src = src;
 	return(new);
 }
 
@@ -437,12 +1171,13 @@ void ann_acc_free(struct ann_acc *acc) {
 }
 
 
-int lomoji_add_annotations(lomoji_ctx_t *ctx, char **annotations) {
+/* parse the annotations file src->path, recording what it held in src, which
+ * must be recording.  Returns 1 if the file could be opened. */
+static int ann_parse_file(lomoji_source_t *src) {
 	int in;
 	char ibuf[8192];
 	size_t ilen;
-	char *filename;
-	int openedok=0;
+	char *filename = src->path;
 
 	const GMarkupParser ann_xml_parser = {
 		ann_parser_start_element,
@@ -457,45 +1192,102 @@ int lomoji_add_annotations(lomoji_ctx_t *ctx, char **annotations) {
 
 	struct ann_acc *acc;
 
-	/* make sure the ctx pointer isn't null. */
-	if(!ctx) return((errno = EPERM));
+	/* Can't open the filename?  hummmm..... */
+	if((in = open(filename,O_RDONLY))==-1) {
+		/* if it doesn't exist, no big deal, but otherwise... */
+		if(errno != ENOENT) {
+			fprintf(stderr,"Couldn't open '%s': %s\n",
+				filename,
+				strerror(errno)
+			);
+		}
+		return(0);
+	}
 
-	for(int f=0;annotations[f];f++) {
-		filename = annotations[f];
-
-		/* Can't open the filename?  hummmm..... */
-		if((in = open(filename,O_RDONLY))==-1) {
-			/* if it doesn't exist, no big deal, but otherwise... */
-			if(errno != ENOENT) {
-				fprintf(stderr,"Couldn't open '%s': %s\n",
-					filename,
-					strerror(errno)
-				);
-			}
-			continue;
+	acc = ann_acc_new(src);
+
+	context = g_markup_parse_context_new(	
+		&ann_xml_parser, G_MARKUP_DEFAULT_FLAGS,acc, NULL
+	);
+
+	while( (ilen = read(in,ibuf,sizeof(ibuf))) >0)  {
+		success = g_markup_parse_context_parse(context,ibuf,ilen,NULL);
+		if(!success) {
+			fprintf(stderr,"lomoji: Error parsing '%s'\n",filename);
+			break;
 		}
+	}
 
-		openedok++;
+	/* cleanup. */
+	ann_acc_free(acc);
+	g_markup_parse_context_free(context);
+	close(in);
+	return(1);
+}
 
-		acc = ann_acc_new(ctx);
+static gpointer ann_parse_worker(gpointer data) {
+	return(GINT_TO_POINTER(ann_parse_file((lomoji_source_t *)data)));
+}
 
-		context = g_markup_parse_context_new(	
-			&ann_xml_parser, G_MARKUP_DEFAULT_FLAGS,acc, NULL
-		);
+/* parse ctx's sources from index from on, each into its own tables, and
+ * merge them into ctx in order.  The sources must be recording, each into an
+ * arena of its own.  With more than one file and more than one processor, the
+ * files are parsed at the same time, each on its own thread, and the merge
+ * takes each one as soon as it and the ones before it are done.  Their
+ * aliases are left for alias_ready().  Returns how many of the files could be
+ * opened. */
+static int ann_parse_sources(lomoji_ctx_t *ctx, guint from) {
+	guint n = ctx->sources->len - from;
+	GThread **workers = g_new0(GThread *,n);
+	int openedok = 0;
+
+	if(n > 1 && g_get_num_processors() > 1) {
+		for(guint i=0;i<n;i++) {
+			/* if a thread can't be had, that file is parsed here instead. */
+			workers[i] = g_thread_try_new("lomoji-parse",ann_parse_worker,
+				g_ptr_array_index(ctx->sources,from+i),NULL);
+		}
+	}
 
-		while( (ilen = read(in,ibuf,sizeof(ibuf))) >0)  {
-			success = g_markup_parse_context_parse(context,ibuf,ilen,NULL);
-			if(!success) {
-				fprintf(stderr,"lomoji: Error parsing '%s'\n",filename);
-				break;
-			}
+	for(guint i=0;i<n;i++) {
+		lomoji_source_t *src = g_ptr_array_index(ctx->sources,from+i);
+
+		if(workers[i]) {
+			openedok += GPOINTER_TO_INT(g_thread_join(workers[i]));
+		} else {
+			openedok += ann_parse_file(src);
 		}
-	
-		/* cleanup. */
-		ann_acc_free(acc);
-		g_markup_parse_context_free(context);
-		close(in);
+		source_merge(ctx,src);
+	}
+	if(n && !ctx->alias_pending) {
+		ctx->alias_from = from;
+		g_atomic_int_set(&ctx->alias_pending,1);
+	}
+
+	g_free(workers);
+	return(openedok);
+}
+
+int lomoji_add_annotations(lomoji_ctx_t *ctx, char **annotations) {
+	char *filename;
+	int openedok=0;
+	guint from;
+
+	/* make sure the ctx pointer isn't null. */
+	if(!ctx) return((errno = EPERM));
+	if(ctx->published || ctx->overlays) return((errno = EBUSY));
+
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+
+	/* remember what was looked at, and what it held, for the snapshot
+	 * staleness check and lomoji_ctx_refresh().  That record is also what
+	 * gets merged into ctx. */
+	from = ctx->sources->len;
+	for(int f=0;annotations[f];f++) {
+		source_record(ctx_add_source(ctx,annotations[f]),arena_new(ctx->arena->under));
 	}
+	openedok = ann_parse_sources(ctx,from);
 
 	/* and if nothing opened ok.. thats a problem. */
 	if(openedok == 0) {
@@ -514,399 +1306,3679 @@ int lomoji_add_annotations(lomoji_ctx_t *ctx, char **annotations) {
 	return(0);
 }
 
+/* work out what cp's name is after merging all of the sources, in order. */
+static gchar *refresh_tts(lomoji_ctx_t *ctx, const gchar *cp) {
+	const gchar *v;
 
-/* look for an ascii equivalent char. */
-int filter_equiv(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	for(guint i=ctx->sources->len;i>0;i--) {
+		lomoji_source_t *src = g_ptr_array_index(ctx->sources,i-1);
+		if( (v = g_hash_table_lookup(src->tts,cp)) ) return(g_strdup(v));
+	}
+	/* what an overlay doesn't have, its base does. */
+	return(ctx->base ? NULL : g_strdup(oneoffs_tts(cp)));
+}
 
-	gchar *sub;
-	if( (sub = g_hash_table_lookup(ctx->cp_equiv,check)) ) { 
-		(*out) = g_string_append((*out),sub);
-		return(1);
+/* and what an alias points at.  An alias from a tts entry replaces what came
+ * before, but a plain one only gets used if nothing came before. */
+static gchar *refresh_alias(lomoji_ctx_t *ctx, const gchar *alias) {
+	gchar *ret = ctx->base ? NULL : oneoffs_alias(alias);
+	int before = ctx->base && ctx_lookup_alias(ctx->base,alias,strlen(alias));
+	added_alias_t *a = ctx->added ? g_hash_table_lookup(ctx->added,alias) : NULL;
+	const gchar *v;
+
+	for(guint i=0;i<=ctx->sources->len;i++) {
+		lomoji_source_t *src;
+
+		/* one from lomoji_add_alias() replaces, like one from a name. */
+		if(a && a->at == i) {
+			g_free(ret);
+			ret = g_strdup(a->cp);
+		}
+		if(i == ctx->sources->len) break;
+		src = g_ptr_array_index(ctx->sources,i);
+		if( (v = g_hash_table_lookup(src->alias_set,alias)) ) {
+			g_free(ret);
+			ret = g_strdup(v);
+		} else if(!ret && !before && (v = g_hash_table_lookup(src->alias_add,alias)) ) {
+			ret = g_strdup(v);
+		}
 	}
-	return(0);
+	return(ret);
 }
 
-/* look for a name. */
-int filter_toname(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+static void refresh_collect(GHashTable *into, GHashTable *from) {
+	GHashTableIter it;
+	gpointer key;
 
-	gchar *sub;
-	if( (sub = g_hash_table_lookup(ctx->cp_tts,check)) ) {
-		/* a substitution was found. */
-		if( (strlen(sub) <= 1) ) {
-			/* if the substitution is a single character, don't bother
-			 * wrapping it. */
-			*out = g_string_append(*out,sub);
-			return(1);
-		} else {
-			*out = g_string_append(*out,ctx->tts_prefix);
-			*out = g_string_append(*out,sub);
-			*out = g_string_append(*out,ctx->tts_suffix);
-			return(1);
-		} 
+	g_hash_table_iter_init(&it,from);
+	while(g_hash_table_iter_next(&it,&key,NULL)) {
+		g_hash_table_add(into,g_strdup(key));
 	}
-	return(0);
 }
 
-/* look for a :emoji: type name, and emit the grapheme if found. */
-int filter_fromname(lomoji_ctx_t *ctx, gchar *check, GString **out) {
-
-	GTreeNode *node;
-	char *completion;
-	gchar *k,*v;
-	gchar *keypart;
+int lomoji_ctx_refresh(lomoji_ctx_t *ctx) {
+	GHashTable *cps, *aliases;
+	GHashTableIter it;
+	gpointer key;
+	GPtrArray *changed;
+	gint64 mtime, size;
+	int full = 0, merged = 0;
 
-	/* use the first possible completion. */
-	completion = lomoji_suggest_ext(ctx,check,1,NULL);
-	if(!completion) {
-		return(0);
+	if(!ctx) return((errno = EPERM));
+	if(ctx->published || ctx->overlays) return((errno = EBUSY));
+
+	changed = g_ptr_array_new();
+	for(guint i=0;i<ctx->sources->len;i++) {
+		lomoji_source_t *src = g_ptr_array_index(ctx->sources,i);
+		source_stat(src->path,&mtime,&size);
+		if(mtime != src->mtime || size != src->size) {
+			g_ptr_array_add(changed,src);
+			/* are its aliases in the context already? */
+			if(!ctx->alias_pending || i < ctx->alias_from) merged = 1;
+		}
+		/* without a record of every source, it has to start over. */
+		if(!src->tts) full = 1;
 	}
-
-	keypart = keypart_dup(ctx,completion);
-	free(completion);
-	if(!keypart) {
+	if(changed->len == 0) {
+		g_ptr_array_free(changed,TRUE);
 		return(0);
 	}
 
-	node = g_tree_lower_bound(ctx->alias_cp,keypart);
-	if(!node) {
-		g_free(keypart);
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+
+	if(full) {
+		arena_t *old = ctx->arena;
+		cp_table_t *equiv = ctx->cp_equiv;
+
+		/* names and aliases all come from the oneoffs, the sources and
+		 * lomoji_add_alias().  The equivalents don't, so they are copied
+		 * over as they are.  Everything else starts over in a new arena,
+		 * and the strings the old names and aliases had go with the old
+		 * one. */
+		ctx->arena = arena_new(old->under);
+		ctx->cp_equiv = equiv ? cp_table_copy(equiv,ctx->arena) : NULL;
+		cp_table_free(equiv);
+		cp_table_free(ctx->cp_tts);
+		if(ctx->alias_cp) g_tree_destroy(ctx->alias_cp);
+		alias_ix_free(ctx->alias_ix);
+		ctx->alias_ix = NULL;
+		ctx->cp_tts = cp_table_new(ctx->arena);
+		ctx->alias_cp = g_tree_new_full(treecompare,NULL,NULL,NULL);
+		if(!ctx->base) oneoffs_insert(ctx);
+		for(guint i=0;i<ctx->sources->len;i++) {
+			lomoji_source_t *src = g_ptr_array_index(ctx->sources,i);
+			source_stat(src->path,&src->mtime,&src->size);
+			source_forget(src);
+			source_record(src,arena_new(ctx->arena->under));
+		}
+		ctx->alias_pending = 0;
+		ann_parse_sources(ctx,0);
+		arena_free(old);
+		g_ptr_array_free(changed,TRUE);
 		return(0);
 	}
 
-	k=g_tree_node_key(node);
-	v=g_tree_node_value(node);
+	/* if the changed files' aliases haven't been put in yet, they just get
+	 * put in as they are now, when they are.  Otherwise, this needs the
+	 * aliases of every source, to work out the changed ones again. */
+	if(merged) alias_unpack(ctx);
+
+	/* re-read just the changed files, and note every key they had before or
+	 * have now. */
+	cps = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,NULL);
+	aliases = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,NULL);
+	for(guint i=0;i<changed->len;i++) {
+		lomoji_source_t *src = g_ptr_array_index(changed,i);
+
+		refresh_collect(cps,src->tts);
+		refresh_collect(aliases,src->alias_set);
+		refresh_collect(aliases,src->alias_add);
+
+		source_forget(src);
+		source_record(src,ctx->arena);
+		source_stat(src->path,&src->mtime,&src->size);
+		ann_parse_file(src);
+		if(merged) source_expand(src);
+
+		refresh_collect(cps,src->tts);
+		refresh_collect(aliases,src->alias_set);
+		refresh_collect(aliases,src->alias_add);
+	}
 
-	if(strncmp(k,keypart,strlen(keypart))!=0) {
-		g_free(keypart);
-		return(0);
+	/* and work out each of those keys again, over all of the sources. */
+	g_hash_table_iter_init(&it,cps);
+	while(g_hash_table_iter_next(&it,&key,NULL)) {
+		gchar *v = refresh_tts(ctx,key);
+		if(v) {
+			cp_table_insert(ctx_own_table(ctx,0),key,strlen(key),arena_take(ctx->arena,v));
+		} else if(ctx->cp_tts) {
+			cp_table_remove(ctx->cp_tts,key,strlen(key));
+		}
+	}
+	g_hash_table_iter_init(&it,aliases);
+	while(g_hash_table_iter_next(&it,&key,NULL)) {
+		gchar *v = refresh_alias(ctx,key);
+		if(v) {
+			g_tree_insert(ctx->alias_cp,(gpointer)arena_strdup(ctx->arena,key),(gpointer)arena_take(ctx->arena,v));
+		} else {
+			g_tree_remove(ctx->alias_cp,key);
+		}
 	}
 
-	/* oooh.  It worked! */
-	*out = g_string_append(*out,v);
-	g_free(keypart);
-	return(1);
+	g_hash_table_destroy(cps);
+	g_hash_table_destroy(aliases);
+	g_ptr_array_free(changed,TRUE);
+	if(merged) alias_pack(ctx);
+	return(0);
 }
 
 
-/* translate grapheme into \U+x notation. */
-int filter_uplus(lomoji_ctx_t *ctx, gchar *check, GString **out) {
-	gchar *start, *end, *cp;
-	char buf[1024];
-	gunichar c;
-	
-	for(start = check;*start;start=end) {
-		end = g_utf8_find_next_char(start,NULL);
-		cp = g_utf8_substring(start,0,
-			g_utf8_pointer_to_offset(start,end)
-		);
-		c = g_utf8_get_char(cp);
-		g_snprintf(buf,sizeof(buf),"\\U+%x ",c);
-		*out = g_string_append(*out,buf);
-		g_free(cp);
-	}
-	return(1);
+/*---- table access ----*/
+
+/* These hide whether a context's tables are live glib structures, or are
+ * being served out of a mapped snapshot file. */
+
+/* is a snapshot entry's key and value inside the snapshot?  Only the
+ * sections are checked when a snapshot is opened, so the entries are checked
+ * as they are read.  The file ends with a nul, so this is enough for them to
+ * be terminated too. */
+static inline int snap_entry_ok(const struct lomoji_snap_s *s, const snap_entry_t *e) {
+	return( e->key < s->size && e->keylen < s->size - e->key &&
+		e->val < s->size && e->vallen < s->size - e->val
+	);
 }
 
-/* look for an ascii equivalent char. */
-int filter_unknown(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+/* compare a snapshot entry's key with a counted string, in strcmp() order.
+ * A broken entry sorts after everything. */
+static int snap_keycmp(const struct lomoji_snap_s *s, const snap_entry_t *e, const gchar *key, gsize len) {
+	int c;
 
-	*out = g_string_append(*out,ctx->unknown);
-	return(1);
+	if(!snap_entry_ok(s,e)) return(1);
+	c = memcmp(s->base + e->key, key, MIN(e->keylen,len));
+
+	if(c) return(c);
+	return((e->keylen < len) ? -1 : (e->keylen > len));
 }
 
-/* Try taking the grapheme apart codepoint by codepoint. */
-int filter_decompose(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+/* binary search a sorted snapshot table for key.  Returns the index of the
+ * first entry that is >= key, which may be n. */
+static guint32 snap_lower_bound_len(const struct lomoji_snap_s *s, const snap_entry_t *tab, guint32 n, const gchar *key, gsize len) {
+	guint32 lo = 0, hi = n;
 
-	gchar *start, *end, *cp;
-	for(start = check;*start;start=end) {
-		end = g_utf8_find_next_char(start,NULL);
-		cp = g_utf8_substring(start,0,
-			g_utf8_pointer_to_offset(start,end)
-		);
-		if( filter_toname(ctx,cp,out) == 0 ) {
-			filter_unknown(ctx,cp,out);
+	while(lo < hi) {
+		guint32 mid = lo + (hi - lo)/2;
+		if(snap_keycmp(s,tab+mid,key,len) < 0) {
+			lo = mid+1;
+		} else {
+			hi = mid;
 		}
-		g_free(cp);
 	}
-	return(1);
+	return(lo);
 }
 
-/* use glib's built in inconv based str_to_ascii() */
-int filter_iconv(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+static guint32 snap_lower_bound(const struct lomoji_snap_s *s, const snap_entry_t *tab, guint32 n, const gchar *key) {
+	return(snap_lower_bound_len(s,tab,n,key,strlen(key)));
+}
 
-	gchar *sub;
-	sub = g_str_to_ascii(check,NULL);
-	*out = g_string_append(*out,sub);
-	free(sub);
+/* look up key in a hashed snapshot table. */
+static const gchar *snap_lookup(const struct lomoji_snap_s *s, const snap_entry_t *tab, guint32 n, const snap_mph_t *mph, const guint32 *disp, const gchar *key, gsize len) {
+	const snap_entry_t *e;
 
-	return(1);
+	if(n == 0) return(NULL);
+
+	e = tab + mph_slot(mph,disp,n,mph_hash(key,len,mph->seed));
+	if(e->keylen == len && snap_entry_ok(s,e) && !memcmp(s->base + e->key,key,len)) {
+		return(s->base + e->val);
+	}
+	return(NULL);
 }
 
-int lomoji_add_equiv(lomoji_ctx_t *ctx, lomoji_equiv_t *source) {
+/* look up a single codepoint in a snapshot's two level array. */
+static inline const gchar *snap_cp_lookup(const struct lomoji_snap_s *s, const guint16 *dir, const guint32 *pages, gunichar c) {
+	guint32 off = pages[ (dir[c >> CP_PAGE_BITS] << CP_PAGE_BITS) | (c & (CP_PAGE_SIZE-1)) ];
 
-	lomoji_equiv_t *e;
-	gchar *start,*end,*cp;
-	char ascii[2] = " ";
+	return((off && off < s->size) ? s->base + off : NULL);
+}
 
-	/* make sure the ctx pointer isn't null. */
-	if(!ctx) return((errno = EPERM));
+static const gchar *ctx_lookup_tts(lomoji_ctx_t *ctx, const gchar *cp, gsize len) {
+	gunichar c = cp_decode(cp,len);
+	const gchar *v;
 
-	if(!source) source=default_equiv;
+	if(ctx->base) {
+		/* an overlay's own entries come first. */
+		if(ctx->cp_tts && (v = cp_table_lookup(ctx->cp_tts,cp,len,c))) return(v);
+		return(ctx_lookup_tts(ctx->base,cp,len));
+	}
 
-	for(e=source;e && e->ascii;e++) {
-		for(start = e->utf;*start;start = end) {
-			end = g_utf8_find_next_char(start,NULL);
-			cp = g_utf8_substring(start,0,
-				g_utf8_pointer_to_offset(start,end)
-			);
-			/* useful for finding duplicates in the entries.
-			gchar *dup;
-			if((dup = (gchar*) g_hash_table_lookup(ctx->cp_equiv,cp))) {
-				fprintf(stderr,"Duplicate codepoint: %s was %s\n",cp,dup);
-			}
-			*/
-			*ascii = e->ascii;
-			g_hash_table_insert(ctx->cp_equiv,cp,g_strdup(ascii));
+	if(ctx->snap) {
+		struct lomoji_snap_s *s = ctx->snap;
+		if(c != CP_NONE) {
+			return(snap_cp_lookup(s,s->tts_dir,s->tts_pages,c));
 		}
+		return(snap_lookup(s,s->tts,s->hdr->ntts,&s->hdr->tts_mph,s->tts_disp,cp,len));
 	}
+	return(cp_table_lookup(ctx->cp_tts,cp,len,c));
+}
 
+static const gchar *ctx_lookup_equiv(lomoji_ctx_t *ctx, const gchar *cp, gsize len) {
+	gunichar c = cp_decode(cp,len);
+	const gchar *v;
+
+	if(ctx->base) {
+		if(ctx->cp_equiv && (v = cp_table_lookup(ctx->cp_equiv,cp,len,c))) return(v);
+		return(ctx_lookup_equiv(ctx->base,cp,len));
+	}
+
+	if(ctx->snap) {
+		struct lomoji_snap_s *s = ctx->snap;
+		if(c != CP_NONE) {
+			return(snap_cp_lookup(s,s->equiv_dir,s->equiv_pages,c));
+		}
+		return(snap_lookup(s,s->equiv,s->hdr->nequiv,&s->hdr->equiv_mph,s->equiv_disp,cp,len));
+	}
+	return(cp_table_lookup(ctx->cp_equiv,cp,len,c));
+}
+
+/* the value for the single codepoint c, from whichever form ctx is in. */
+static const gchar *ctx_lookup_single(lomoji_ctx_t *ctx, int equiv, gunichar c) {
+	if(ctx->base) {
+		cp_table_t *t = equiv ? ctx->cp_equiv : ctx->cp_tts;
+		const gchar *v;
+
+		if(t && (v = cp_table_lookup(t,NULL,0,c))) return(v);
+		return(ctx_lookup_single(ctx->base,equiv,c));
+	}
+	if(ctx->snap) {
+		struct lomoji_snap_s *s = ctx->snap;
+		return(equiv ?
+			snap_cp_lookup(s,s->equiv_dir,s->equiv_pages,c) :
+			snap_cp_lookup(s,s->tts_dir,s->tts_pages,c)
+		);
+	}
+	return(cp_table_lookup(equiv ? ctx->cp_equiv : ctx->cp_tts,NULL,0,c));
+}
+
+/* does page p of the single codepoint array have anything in it? */
+static int ctx_single_page_used(lomoji_ctx_t *ctx, int equiv, guint32 p) {
+	if(ctx->base) {
+		cp_table_t *t = equiv ? ctx->cp_equiv : ctx->cp_tts;
+
+		return((t && t->page[p]) || ctx_single_page_used(ctx->base,equiv,p));
+	}
+	if(ctx->snap) {
+		return((equiv ? ctx->snap->equiv_dir : ctx->snap->tts_dir)[p] != 0);
+	}
+	return((equiv ? ctx->cp_equiv : ctx->cp_tts)->page[p] != NULL);
+}
+
+/* under is where to look for a string before copying it in, or NULL.  It
+ * must outlast the new arena, and not change while the new one is in use. */
+static arena_t *arena_new(const arena_t *under) {
+	arena_t *a = g_new0(arena_t,1);
+
+	a->blocks = g_ptr_array_new_with_free_func(g_free);
+	a->strings = g_hash_table_new(slice_hash,slice_equal);
+	a->under = under;
+	return(a);
+}
+
+static void arena_free(arena_t *a) {
+	if(!a) return;
+	g_hash_table_destroy(a->strings);
+	g_ptr_array_free(a->blocks,TRUE);
+	g_free(a);
+}
+
+/* size bytes of zeroed memory that lasts as long as the arena. */
+static gpointer arena_alloc(arena_t *a, gsize size) {
+	gpointer p;
+
+	size = ARENA_ALIGN(size);
+	if(size > a->left) {
+		/* something big gets a block to itself, rather than wasting what's
+		 * left of this one. */
+		if(size > ARENA_BLOCK / 4) {
+			p = g_malloc0(size);
+			g_ptr_array_add(a->blocks,p);
+			return(p);
+		}
+		/* start small, so that an overlay with an alias or two doesn't
+		 * take a whole block for them. */
+		a->grow = a->grow ? MIN(a->grow * 2,ARENA_BLOCK) : ARENA_FIRST;
+		while(a->grow < size) a->grow *= 2;
+		a->at = g_malloc0(a->grow);
+		a->left = a->grow;
+		g_ptr_array_add(a->blocks,a->at);
+	}
+	p = a->at;
+	a->at += size;
+	a->left -= size;
+	return(p);
+}
+
+/* the arena's one copy of [str,str+len), which is nul-terminated.  If an
+ * arena under it has a copy already, that one is used instead. */
+static const lomoji_slice_t *arena_intern(arena_t *a, const gchar *str, gsize len) {
+	lomoji_slice_t k = { str, len };
+	lomoji_slice_t *s;
+	gchar *text;
+
+	if( (s = g_hash_table_lookup(a->strings,&k)) ) return(s);
+	for(const arena_t *u = a->under;u;u = u->under) {
+		if( (s = g_hash_table_lookup(u->strings,&k)) ) return(s);
+	}
+
+	s = arena_alloc(a,sizeof(*s) + len + 1);
+	text = (gchar *)(s + 1);
+	memcpy(text,str,len);
+	s->str = text;
+	s->len = len;
+	g_hash_table_add(a->strings,s);
+	return(s);
+}
+
+static const gchar *arena_strdup(arena_t *a, const gchar *str) {
+	return(arena_intern(a,str,strlen(str))->str);
+}
+
+/* intern a string that was g_malloc()'d, and free it. */
+static const gchar *arena_take(arena_t *a, gchar *str) {
+	const gchar *ret = arena_strdup(a,str);
+
+	g_free(str);
+	return(ret);
+}
+
+/* move everything in from into into, and free from.  A string that into
+ * already had keeps its old copy, and from's copy is just left where it is. */
+static void arena_adopt(arena_t *into, arena_t *from) {
+	GHashTableIter it;
+	gpointer s;
+
+	g_hash_table_iter_init(&it,from->strings);
+	while(g_hash_table_iter_next(&it,&s,NULL)) {
+		if(!g_hash_table_contains(into->strings,s)) g_hash_table_add(into->strings,s);
+	}
+	g_ptr_array_set_free_func(from->blocks,NULL);
+	for(guint i=0;i<from->blocks->len;i++) {
+		g_ptr_array_add(into->blocks,g_ptr_array_index(from->blocks,i));
+	}
+	arena_free(from);
+}
+
+/* same as g_str_hash(), but counted. */
+static guint slice_hash(gconstpointer key) {
+	const lomoji_slice_t *k = key;
+	guint32 h = 5381;
+
+	for(gsize i=0;i<k->len;i++) {
+		h = (h << 5) + h + (signed char)k->str[i];
+	}
+	return(h);
+}
+
+static gboolean slice_equal(gconstpointer a, gconstpointer b) {
+	const lomoji_slice_t *x = a, *y = b;
+
+	return(x->len == y->len && !memcmp(x->str,y->str,x->len));
+}
+
+/* if s is exactly one well formed UTF-8 codepoint, return it.  Otherwise
+ * return CP_NONE. */
+static inline gunichar cp_decode(const gchar *s, gsize len) {
+	const guchar *u = (const guchar *)s;
+	gunichar c;
+
+	switch(len) {
+		case 1:
+			return((u[0] < 0x80) ? u[0] : CP_NONE);
+		case 2:
+			if((u[0] & 0xe0) != 0xc0 || (u[1] & 0xc0) != 0x80) break;
+			c = ((u[0] & 0x1f) << 6) | (u[1] & 0x3f);
+			return((c >= 0x80) ? c : CP_NONE);
+		case 3:
+			if((u[0] & 0xf0) != 0xe0 || (u[1] & 0xc0) != 0x80 || (u[2] & 0xc0) != 0x80) break;
+			c = ((u[0] & 0x0f) << 12) | ((u[1] & 0x3f) << 6) | (u[2] & 0x3f);
+			return((c >= 0x800) ? c : CP_NONE);
+		case 4:
+			if((u[0] & 0xf8) != 0xf0 || (u[1] & 0xc0) != 0x80 ||
+				(u[2] & 0xc0) != 0x80 || (u[3] & 0xc0) != 0x80
+			) {
+				break;
+			}
+			c = ((u[0] & 0x07) << 18) | ((u[1] & 0x3f) << 12) | ((u[2] & 0x3f) << 6) | (u[3] & 0x3f);
+			return((c >= 0x10000 && c <= 0x10ffff) ? c : CP_NONE);
+	}
+	return(CP_NONE);
+}
+
+static cp_table_t *cp_table_new(arena_t *arena) {
+	cp_table_t *new = g_new0(cp_table_t,1);
+	trie_node_t root = { 0 };
+
+	new->arena = arena;
+	new->seq = g_hash_table_new(slice_hash,slice_equal);
+	new->trie = g_array_new(FALSE,FALSE,sizeof(trie_node_t));
+	g_array_append_val(new->trie,root);
+	return(new);
+}
+
+/* the keys, values and pages stay in the arena. */
+static void cp_table_free(cp_table_t *t) {
+	if(!t) return;
+
+	g_hash_table_destroy(t->seq);
+	g_array_free(t->trie,TRUE);
+	g_free(t);
+}
+
+/* a copy of t, with its strings in arena. */
+static cp_table_t *cp_table_copy(cp_table_t *t, arena_t *arena) {
+	cp_table_t *new = cp_table_new(arena);
+	GHashTableIter it;
+	gpointer key, value;
+	gchar utf[8];
+
+	for(guint32 p=0;p<CP_PAGES;p++) {
+		if(!t->page[p]) continue;
+		for(guint32 o=0;o<CP_PAGE_SIZE;o++) {
+			if(!t->page[p][o]) continue;
+			cp_table_insert(new,utf,g_unichar_to_utf8((p << CP_PAGE_BITS) | o,utf),arena_strdup(arena,t->page[p][o]));
+		}
+	}
+	g_hash_table_iter_init(&it,t->seq);
+	while(g_hash_table_iter_next(&it,&key,&value)) {
+		const lomoji_slice_t *k = key;
+		cp_table_insert(new,k->str,k->len,arena_strdup(arena,value));
+	}
+	return(new);
+}
+
+/* add or replace the value for key.  value must already be in the table's
+ * arena. */
+static void cp_table_insert(cp_table_t *t, const gchar *key, gsize len, const gchar *value) {
+	gunichar c = cp_decode(key,len);
+	const gchar **page, **slot;
+
+	if(c == CP_NONE) {
+		g_hash_table_insert(t->seq,(gpointer)arena_intern(t->arena,key,len),(gpointer)value);
+		trie_insert(t->trie,key,len);
+		return;
+	}
+
+	if( !(page = t->page[c >> CP_PAGE_BITS]) ) {
+		page = t->page[c >> CP_PAGE_BITS] = arena_alloc(t->arena,CP_PAGE_SIZE*sizeof(*page));
+	}
+	slot = &page[c & (CP_PAGE_SIZE-1)];
+	if(!*slot) {
+		t->singles++;
+	}
+	*slot = value;
+}
+
+/* c is cp_decode(key,len), which the caller usually has already. */
+static const gchar *cp_table_lookup(cp_table_t *t, const gchar *key, gsize len, gunichar c) {
+	lomoji_slice_t k = { key, len };
+	const gchar **page;
+
+	if(c != CP_NONE) {
+		page = t->page[c >> CP_PAGE_BITS];
+		return(page ? page[c & (CP_PAGE_SIZE-1)] : NULL);
+	}
+	return(g_hash_table_lookup(t->seq,&k));
+}
+
+static void cp_table_remove(cp_table_t *t, const gchar *key, gsize len) {
+	gunichar c = cp_decode(key,len);
+	lomoji_slice_t k = { key, len };
+	const gchar **page;
+
+	if(c != CP_NONE) {
+		page = t->page[c >> CP_PAGE_BITS];
+		if(page && page[c & (CP_PAGE_SIZE-1)]) {
+			page[c & (CP_PAGE_SIZE-1)] = NULL;
+			t->singles--;
+		}
+		return;
+	}
+	if(g_hash_table_remove(t->seq,&k)) {
+		trie_unaccept(t->trie,key,len);
+	}
+}
+
+/* add key to a trie.  Nodes are only ever added, never removed, since keys
+ * are only ever replaced. */
+static void trie_insert(GArray *trie, const gchar *key, gsize len) {
+	guint32 at = 0;
+
+	for(gsize i=0;i<len;i++) {
+		guint8 b = (guint8)key[i];
+		guint32 *link = &g_array_index(trie,trie_node_t,at).child;
+		trie_node_t node = { 0 };
+
+		/* find b among the children, or where it goes. */
+		while(*link && g_array_index(trie,trie_node_t,*link).byte < b) {
+			link = &g_array_index(trie,trie_node_t,*link).sibling;
+		}
+		if(*link && g_array_index(trie,trie_node_t,*link).byte == b) {
+			at = *link;
+			continue;
+		}
+		node.byte = b;
+		node.sibling = *link;
+		/* link may move when the array grows. */
+		*link = trie->len;
+		at = trie->len;
+		g_array_append_val(trie,node);
+	}
+	if(at) g_array_index(trie,trie_node_t,at).accept = 1;
+}
+
+/* take key back out of a trie.  Its nodes stay, but it no longer matches. */
+static void trie_unaccept(GArray *trie, const gchar *key, gsize len) {
+	const trie_node_t *nodes = (const trie_node_t *)trie->data;
+	guint32 at = 0;
+
+	for(gsize i=0;i<len;i++) {
+		guint32 c = nodes[at].child;
+		while(c && nodes[c].byte != (guint8)key[i]) {
+			c = nodes[c].sibling;
+		}
+		if(!c) return;
+		at = c;
+	}
+	if(at) g_array_index(trie,trie_node_t,at).accept = 0;
+}
+
+/* the length of the longest key in the trie that p starts with, or 0 if there
+ * isn't one.  This is a single pass over the bytes. */
+static gsize trie_match(const trie_node_t *nodes, guint32 n, const gchar *p, const gchar *stop) {
+	guint32 at = 0;
+	gsize best = 0;
+
+	if(n == 0) return(0);
+
+	for(const gchar *q = p;q < stop;q++) {
+		guint8 b = (guint8)*q;
+		guint32 c = nodes[at].child;
+
+		while(c && nodes[c].byte < b) {
+			c = nodes[c].sibling;
+		}
+		if(!c || nodes[c].byte != b) break;
+		at = c;
+		if(nodes[at].accept) best = q + 1 - p;
+	}
+	return(best);
+}
+
+/* the longest sequence at p in a live table, if there is one. */
+static gsize table_match(cp_table_t *t, const gchar *p, const gchar *stop) {
+	return(t ? trie_match((trie_node_t *)t->trie->data,t->trie->len,p,stop) : 0);
+}
+
+/* the longest multi-codepoint tts sequence at p, or 0. */
+static gsize ctx_match_tts(lomoji_ctx_t *ctx, const gchar *p, const gchar *stop) {
+	if(ctx->base) {
+		return(MAX(table_match(ctx->cp_tts,p,stop),ctx_match_tts(ctx->base,p,stop)));
+	}
+	if(ctx->snap) {
+		return(trie_match(ctx->snap->tts_trie,ctx->snap->hdr->tts_trie.count,p,stop));
+	}
+	return(trie_match((trie_node_t *)ctx->cp_tts->trie->data,ctx->cp_tts->trie->len,p,stop));
+}
+
+/* the longest multi-codepoint sequence at p from either table, or 0. */
+static gsize ctx_match(lomoji_ctx_t *ctx, const gchar *p, const gchar *stop) {
+	gsize tts, equiv;
+
+	if(ctx->base) {
+		tts = MAX(table_match(ctx->cp_tts,p,stop),table_match(ctx->cp_equiv,p,stop));
+		return(MAX(tts,ctx_match(ctx->base,p,stop)));
+	}
+
+	tts = ctx_match_tts(ctx,p,stop);
+	if(ctx->snap) {
+		equiv = trie_match(ctx->snap->equiv_trie,ctx->snap->hdr->equiv_trie.count,p,stop);
+	} else {
+		equiv = trie_match((trie_node_t *)ctx->cp_equiv->trie->data,ctx->cp_equiv->trie->len,p,stop);
+	}
+	return(MAX(tts,equiv));
+}
+
+/* true if all of [p,stop) is a path in the trie that goes on further, so
+ * a longer key might match once more bytes turn up after stop. */
+static int trie_open(const trie_node_t *nodes, guint32 n, const gchar *p, const gchar *stop) {
+	guint32 at = 0;
+
+	if(n == 0) return(0);
+
+	for(const gchar *q = p;q < stop;q++) {
+		guint8 b = (guint8)*q;
+		guint32 c = nodes[at].child;
+
+		while(c && nodes[c].byte < b) {
+			c = nodes[c].sibling;
+		}
+		if(!c || nodes[c].byte != b) return(0);
+		at = c;
+	}
+	return(nodes[at].child != 0);
+}
+
+/* true if a sequence from either table could still match at p, given more
+ * bytes than [p,stop). */
+static int ctx_match_open(lomoji_ctx_t *ctx, const gchar *p, const gchar *stop) {
+	if(ctx->base) {
+		for(int equiv=0;equiv<2;equiv++) {
+			cp_table_t *t = equiv ? ctx->cp_equiv : ctx->cp_tts;
+			if(t && trie_open((trie_node_t *)t->trie->data,t->trie->len,p,stop)) return(1);
+		}
+		return(ctx_match_open(ctx->base,p,stop));
+	}
+	if(ctx->snap) {
+		return(trie_open(ctx->snap->tts_trie,ctx->snap->hdr->tts_trie.count,p,stop) ||
+			trie_open(ctx->snap->equiv_trie,ctx->snap->hdr->equiv_trie.count,p,stop));
+	}
+	return(trie_open((trie_node_t *)ctx->cp_tts->trie->data,ctx->cp_tts->trie->len,p,stop) ||
+		trie_open((trie_node_t *)ctx->cp_equiv->trie->data,ctx->cp_equiv->trie->len,p,stop));
+}
+
+/* the codepoint for the whole alias name, or NULL.  name doesn't need to be
+ * nul-terminated.  In a snapshot this is one probe, and in the packed index a
+ * binary search and a scan of one block.  While the aliases are still in the
+ * alias_cp tree, which is only while loading, it always returns NULL. */
+static const gchar *ctx_lookup_alias(lomoji_ctx_t *ctx, const gchar *name, gsize len) {
+	const gchar *v;
+
+	alias_ready(ctx);
+
+	if(ctx->base) {
+		if(ctx->alias_ix && (v = alias_ix_lookup(ctx->alias_ix,name,len))) return(v);
+		return(ctx_lookup_alias(ctx->base,name,len));
+	}
+
+	if(ctx->snap) {
+		struct lomoji_snap_s *s = ctx->snap;
+		return(snap_lookup(s,s->exact,s->hdr->nexact,&s->hdr->exact_mph,s->exact_disp,name,len));
+	}
+	if(ctx->alias_ix) {
+		return(alias_ix_lookup(ctx->alias_ix,name,len));
+	}
+	return(NULL);
+}
+
+/* position w on the first of ctx's own aliases >= key. */
+static void alias_walk_seek(lomoji_ctx_t *ctx, alias_walk *w, const gchar *key) {
+	alias_ready(ctx);
+	memset(w,0,sizeof(*w));
+	if(ctx->snap) {
+		guint32 n = ctx->snap->hdr->nalias;
+		guint32 i = snap_lower_bound(ctx->snap,ctx->snap->alias,n,key);
+		w->snap = ctx->snap;
+		w->e = ctx->snap->alias + i;
+		w->end = ctx->snap->alias + n;
+		return;
+	}
+	if(ctx->alias_ix) {
+		alias_ix_seek(ctx->alias_ix,w,key);
+		return;
+	}
+	/* an overlay that has no aliases of its own has no tree either. */
+	if(ctx->alias_cp) w->node = g_tree_lower_bound(ctx->alias_cp,key);
+}
+
+static void alias_walk_next(alias_walk *w) {
+	if(w->e) {
+		if(w->e < w->end) w->e++;
+	} else if(w->ix) {
+		if(w->i < w->ix->n) {
+			w->i++;
+			alias_ix_decode(w);
+		}
+	} else if(w->node) {
+		w->node = g_tree_node_next(w->node);
+	}
+}
+
+/* returns NULL when the walk has run off the end. */
+static const gchar *alias_walk_key(alias_walk *w) {
+	if(w->e) {
+		return((w->e < w->end && snap_entry_ok(w->snap,w->e))?(w->snap->base + w->e->key):NULL);
+	}
+	if(w->ix) {
+		return(w->key);
+	}
+	return((w->node)?g_tree_node_key(w->node):NULL);
+}
+
+static const gchar *alias_walk_value(alias_walk *w) {
+	if(w->e) {
+		return((w->e < w->end && snap_entry_ok(w->snap,w->e))?(w->snap->base + w->e->val):NULL);
+	}
+	if(w->ix) {
+		return((w->i < w->ix->n)?(w->ix->vals + w->ix->val[w->i]):NULL);
+	}
+	return((w->node)?g_tree_node_value(w->node):NULL);
+}
+
+/* put the cursor on whichever walk has the lowest key, the nearest one if
+ * more than one has it, and skip the other walks' copies of that key. */
+static void alias_pick(alias_cursor *c) {
+	const gchar *best = NULL, *k;
+
+	c->at = 0;
+	if(c->n < 2) return;
+
+	for(int i=0;i<c->n;i++) {
+		if( (k = alias_walk_key(&c->w[i])) && (!best || strcmp(k,best) < 0) ) {
+			best = k;
+			c->at = i;
+		}
+	}
+	if(!best) return;
+	for(int i=c->at+1;i<c->n;i++) {
+		if( (k = alias_walk_key(&c->w[i])) && strcmp(k,best) == 0 ) {
+			alias_walk_next(&c->w[i]);
+		}
+	}
+}
+
+/* position the cursor on the first alias >= key.  Returns 0 if there is no
+ * such alias. */
+static int alias_seek(lomoji_ctx_t *ctx, alias_cursor *c, const gchar *key) {
+	c->n = 0;
+	for(lomoji_ctx_t *t = ctx;t;t = t->base) {
+		alias_walk_seek(t,&c->w[c->n++],key);
+	}
+	alias_pick(c);
+	return(alias_key(c) != NULL);
+}
+
+static void alias_next(alias_cursor *c) {
+	alias_walk_next(&c->w[c->at]);
+	alias_pick(c);
+}
+
+/* returns NULL when the cursor has run off the end. */
+static const gchar *alias_key(alias_cursor *c) {
+	return(alias_walk_key(&c->w[c->at]));
+}
+
+static const gchar *alias_value(alias_cursor *c) {
+	return(alias_walk_value(&c->w[c->at]));
+}
+
+/* decode the key of entry c->i, which starts at c->next, into c->key. */
+static void alias_ix_decode(alias_walk *c) {
+	const gchar *p = c->next;
+	guint8 shared = 0;
+
+	if(c->i >= c->ix->n) {
+		c->key = NULL;
+		return;
+	}
+	if(c->i % ALIAS_BLOCK) {
+		shared = (guint8)*p++;
+	}
+	if(shared == 0) {
+		/* stored whole, so use it where it is. */
+		c->key = p;
+	} else {
+		/* the shared part is already in buf if the last key was decoded
+		 * there. */
+		if(c->key != c->buf) memcpy(c->buf,c->key,shared);
+		strcpy(c->buf + shared,p);
+		c->key = c->buf;
+	}
+	c->next = p + strlen(p) + 1;
+}
+
+/* position c on the first key >= key in the packed index. */
+static int alias_ix_seek(const alias_index_t *ix, alias_walk *c, const gchar *key) {
+	guint32 lo = 0, hi = ix->nblocks, mid;
+
+	/* find the first block that starts after key.  key is in the one
+	 * before it, if anywhere. */
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(ix->keys + ix->block[mid],key) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo) lo--;
+
+	memset(c,0,sizeof(*c));
+	c->ix = ix;
+	c->i = lo * ALIAS_BLOCK;
+	c->next = ix->nblocks ? ix->keys + ix->block[lo] : NULL;
+	c->key = NULL;
+	alias_ix_decode(c);
+	while(c->key && strcmp(c->key,key) < 0) {
+		c->i++;
+		alias_ix_decode(c);
+	}
+	return(c->key != NULL);
+}
+
+/* compare the nul-terminated key with the counted string name, in strcmp()
+ * order. */
+static inline int alias_keycmp(const gchar *key, const gchar *name, gsize len) {
+	int c = strncmp(key,name,len);
+
+	return(c ? c : (key[len] != '\0'));
+}
+
+/* the value of the key that is exactly [name,name+len) in the packed index,
+ * or NULL.  Nothing is allocated. */
+static const gchar *alias_ix_lookup(const alias_index_t *ix, const gchar *name, gsize len) {
+	guint32 lo = 0, hi = ix->nblocks, mid;
+	alias_walk c;
+	int cmp;
+
+	if(!ix->nblocks) return(NULL);
+
+	/* the last block that starts at or before name. */
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(alias_keycmp(ix->keys + ix->block[mid],name,len) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(!lo) return(NULL);
+	lo--;
+
+	c.ix = ix;
+	c.i = lo * ALIAS_BLOCK;
+	c.next = ix->keys + ix->block[lo];
+	c.key = NULL;
+	for(alias_ix_decode(&c);c.key && c.i < (lo+1) * ALIAS_BLOCK;c.i++,alias_ix_decode(&c)) {
+		if( (cmp = alias_keycmp(c.key,name,len)) >= 0 ) {
+			return(cmp ? NULL : ix->vals + ix->val[c.i]);
+		}
+	}
+	return(NULL);
+}
+
+struct alias_packer {
+	GString *keys;
+	GString *vals;
+	GArray *block;
+	GArray *val;
+	GHashTable *pool;	/* value string to offset+1 in vals. */
+	const gchar *prev;
+	guint32 n;
+};
+
+static gboolean alias_pack_one(gpointer key, gpointer value, gpointer data) {
+	struct alias_packer *pk = data;
+	const gchar *k = key;
+	gsize len = strlen(k);
+	guint32 off;
+	guint8 shared = 0;
+
+	if(pk->n % ALIAS_BLOCK == 0) {
+		off = pk->keys->len;
+		g_array_append_val(pk->block,off);
+	} else {
+		if(len < ALIAS_KEYMAX) {
+			while(shared < 255 && pk->prev[shared] && pk->prev[shared] == k[shared]) {
+				shared++;
+			}
+		}
+		g_string_append_c(pk->keys,(gchar)shared);
+	}
+	g_string_append_len(pk->keys,k + shared,len - shared + 1);
+
+	if( !(off = GPOINTER_TO_UINT(g_hash_table_lookup(pk->pool,value))) ) {
+		off = pk->vals->len + 1;
+		g_string_append_len(pk->vals,value,strlen(value) + 1);
+		g_hash_table_insert(pk->pool,value,GUINT_TO_POINTER(off));
+	}
+	off--;
+	g_array_append_val(pk->val,off);
+
+	pk->prev = k;
+	pk->n++;
+	return(FALSE);
+}
+
+/* replace the alias_cp tree with the packed index, once loading finishes. */
+static void alias_pack(lomoji_ctx_t *ctx) {
+	struct alias_packer pk = { 0 };
+	alias_index_t *ix;
+
+	if(!ctx->alias_cp) return;
+
+	pk.keys = g_string_new("");
+	pk.vals = g_string_new("");
+	pk.block = g_array_new(FALSE,FALSE,sizeof(guint32));
+	pk.val = g_array_new(FALSE,FALSE,sizeof(guint32));
+	pk.pool = g_hash_table_new(g_str_hash,g_str_equal);
+	g_tree_foreach(ctx->alias_cp,alias_pack_one,&pk);
+	g_hash_table_destroy(pk.pool);
+
+	ix = g_new0(alias_index_t,1);
+	ix->n = pk.n;
+	ix->nblocks = pk.block->len;
+	ix->keys = g_string_free(pk.keys,FALSE);
+	ix->vals = g_string_free(pk.vals,FALSE);
+	ix->block = (guint32 *)g_array_free(pk.block,FALSE);
+	ix->val = (guint32 *)g_array_free(pk.val,FALSE);
+
+	g_tree_destroy(ctx->alias_cp);
+	ctx->alias_cp = NULL;
+	ctx->alias_ix = ix;
+
+	/* only now can other threads use it. */
+	g_atomic_int_set(&ctx->alias_pending,ctx->alias_from < ctx->sources->len);
+}
+
+/* and back into a tree, so that aliases can be added, with the sources that
+ * haven't been put in yet put in. */
+static void alias_unpack(lomoji_ctx_t *ctx) {
+	alias_walk c;
+
+	if(!ctx->alias_ix) {
+		if(ctx->alias_cp) alias_merge(ctx);
+		return;
+	}
+
+	ctx->alias_cp = g_tree_new_full(treecompare,NULL,NULL,NULL);
+	for(alias_ix_seek(ctx->alias_ix,&c,"");alias_walk_key(&c);alias_walk_next(&c)) {
+		g_tree_insert(ctx->alias_cp,
+			(gpointer)arena_strdup(ctx->arena,alias_walk_key(&c)),
+			(gpointer)arena_strdup(ctx->arena,alias_walk_value(&c))
+		);
+	}
+	alias_ix_free(ctx->alias_ix);
+	ctx->alias_ix = NULL;
+	alias_merge(ctx);
+}
+
+/* put the aliases that lomoji_add_alias() put in with at sources merged back
+ * into the alias_cp tree.  Putting one in again where it already is changes
+ * nothing. */
+static void alias_replay(lomoji_ctx_t *ctx, guint at) {
+	GHashTableIter it;
+	gpointer key, value;
+
+	if(!ctx->added) return;
+	g_hash_table_iter_init(&it,ctx->added);
+	while(g_hash_table_iter_next(&it,&key,&value)) {
+		added_alias_t *a = value;
+		if(a->at != at) continue;
+		g_tree_insert(ctx->alias_cp,(gpointer)arena_strdup(ctx->arena,key),(gpointer)arena_strdup(ctx->arena,a->cp));
+	}
+}
+
+/* put the aliases of the sources that haven't been yet into the alias_cp
+ * tree, in order, with the added ones where they came among them. */
+static void alias_merge(lomoji_ctx_t *ctx) {
+	arena_t *a = ctx->arena;
+	GHashTableIter it;
+	gpointer key, value;
+
+	for(guint i=ctx->alias_from;i<ctx->sources->len;i++) {
+		lomoji_source_t *src = g_ptr_array_index(ctx->sources,i);
+
+		alias_replay(ctx,i);
+		source_expand(src);
+		/* an alias from a tts entry replaces what came before, but a plain
+		 * one only goes in if there wasn't one. */
+		g_hash_table_iter_init(&it,src->alias_set);
+		while(g_hash_table_iter_next(&it,&key,&value)) {
+			g_tree_insert(ctx->alias_cp,(gpointer)arena_strdup(a,key),(gpointer)arena_strdup(a,value));
+		}
+		g_hash_table_iter_init(&it,src->alias_add);
+		while(g_hash_table_iter_next(&it,&key,&value)) {
+			/* in an overlay, that includes the base having one. */
+			if(g_tree_lookup(ctx->alias_cp,key) == NULL &&
+				!(ctx->base && ctx_lookup_alias(ctx->base,key,strlen(key)))) {
+				g_tree_insert(ctx->alias_cp,(gpointer)arena_strdup(a,key),(gpointer)arena_strdup(a,value));
+			}
+		}
+		if(!ctx->refreshable) {
+			g_hash_table_destroy(src->alias_set);
+			g_hash_table_destroy(src->alias_add);
+			src->alias_set = src->alias_add = NULL;
+		}
+	}
+	alias_replay(ctx,ctx->sources->len);
+	ctx->alias_from = ctx->sources->len;
+}
+
+/* make sure that ctx's aliases are all in the index.  They're put in the
+ * first time they're needed, which might be on several threads at once, even
+ * with a published context. */
+static inline void alias_ready(lomoji_ctx_t *ctx) {
+	if(G_LIKELY(!g_atomic_int_get(&ctx->alias_pending))) return;
+
+	g_mutex_lock(&ctx->alias_lock);
+	if(ctx->alias_pending) {
+		alias_unpack(ctx);
+		alias_pack(ctx);
+	}
+	g_mutex_unlock(&ctx->alias_lock);
+}
+
+static void alias_ix_free(alias_index_t *ix) {
+	if(!ix) return;
+	g_free(ix->keys);
+	g_free(ix->vals);
+	g_free(ix->block);
+	g_free(ix->val);
+	g_free(ix);
+}
+
+/* turn a snapshot backed context back into a live one, so that it can be
+ * modified. Does nothing to a context that is already live, except for an
+ * overlay. */
+static void ctx_thaw(lomoji_ctx_t *ctx) {
+	struct lomoji_snap_s *s;
+	const snap_entry_t *e;
+
+	/* an overlay's alias tree is made the first time it's changed.  Its
+	 * codepoint tables are left until something goes in them. */
+	if(ctx && ctx->base && !ctx->alias_cp && !ctx->alias_ix) {
+		ctx->alias_cp = g_tree_new_full(treecompare,NULL,NULL,NULL);
+	}
+
+	if(!ctx || !(s = ctx->snap)) return;
+
+	ctx->arena = arena_new(NULL);
+	ctx->cp_tts = cp_table_new(ctx->arena);
+	ctx->cp_equiv = cp_table_new(ctx->arena);
+	ctx->alias_cp = g_tree_new_full(treecompare,NULL,NULL,NULL);
+
+	for(e = s->tts; e < s->tts + s->hdr->ntts; e++) {
+		if(!snap_entry_ok(s,e)) continue;
+		cp_table_insert(ctx->cp_tts,s->base+e->key,e->keylen,arena_strdup(ctx->arena,s->base+e->val));
+	}
+	for(e = s->equiv; e < s->equiv + s->hdr->nequiv; e++) {
+		if(!snap_entry_ok(s,e)) continue;
+		cp_table_insert(ctx->cp_equiv,s->base+e->key,e->keylen,arena_strdup(ctx->arena,s->base+e->val));
+	}
+	for(gunichar c=0;c<=0x10ffff;c++) {
+		const gchar *v;
+		gchar utf[8];
+		gint n;
+
+		if((c & (CP_PAGE_SIZE-1)) == 0 && !s->tts_dir[c >> CP_PAGE_BITS] && !s->equiv_dir[c >> CP_PAGE_BITS]) {
+			c += CP_PAGE_SIZE-1;
+			continue;
+		}
+		n = g_unichar_to_utf8(c,utf);
+		if( (v = snap_cp_lookup(s,s->tts_dir,s->tts_pages,c)) ) {
+			cp_table_insert(ctx->cp_tts,utf,n,arena_strdup(ctx->arena,v));
+		}
+		if( (v = snap_cp_lookup(s,s->equiv_dir,s->equiv_pages,c)) ) {
+			cp_table_insert(ctx->cp_equiv,utf,n,arena_strdup(ctx->arena,v));
+		}
+	}
+	for(e = s->alias; e < s->alias + s->hdr->nalias; e++) {
+		if(!snap_entry_ok(s,e)) continue;
+		g_tree_insert(ctx->alias_cp,
+			(gpointer)arena_strdup(ctx->arena,s->base+e->key),
+			(gpointer)arena_strdup(ctx->arena,s->base+e->val)
+		);
+	}
+
+	ctx->snap = NULL;
+	snap_unmap(s);
+}
+
+/* stat a file for the source list.  Missing files get size -1. */
+static void source_stat(const char *path, gint64 *mtime, gint64 *size) {
+	struct stat st;
+
+	if(stat(path,&st) == 0) {
+		*mtime = (gint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		*size = st.st_size;
+	} else {
+		*mtime = 0;
+		*size = -1;
+	}
+}
+
+static lomoji_source_t *ctx_add_source(lomoji_ctx_t *ctx, const char *path) {
+	lomoji_source_t *src;
+
+	src = g_new0(lomoji_source_t,1);
+	src->path = g_strdup(path);
+	source_stat(path,&src->mtime,&src->size);
+	g_ptr_array_add(ctx->sources,src);
+	return(src);
+}
+
+/* start recording what a source holds, with the strings kept in arena. */
+static void source_record(lomoji_source_t *src, struct arena_s *arena) {
+	src->tts = g_hash_table_new(g_str_hash,g_str_equal);
+	src->alias_set = g_hash_table_new(g_str_hash,g_str_equal);
+	src->alias_add = g_hash_table_new(g_str_hash,g_str_equal);
+	src->aliases = g_string_new(NULL);
+	src->arena = arena;
+}
+
+static void source_forget(lomoji_source_t *src) {
+	if(src->tts) g_hash_table_destroy(src->tts);
+	if(src->alias_set) g_hash_table_destroy(src->alias_set);
+	if(src->alias_add) g_hash_table_destroy(src->alias_add);
+	if(src->aliases) g_string_free(src->aliases,TRUE);
+	src->tts = src->alias_set = src->alias_add = NULL;
+	src->aliases = NULL;
+	src->arena = NULL;
+}
+
+/* merge the names a source recorded into ctx, and move its strings into
+ * ctx's arena.  Its aliases are left for alias_merge(). */
+static void source_merge(lomoji_ctx_t *ctx, lomoji_source_t *src) {
+	arena_t *a = ctx->arena;
+	GHashTableIter it;
+	gpointer key, value;
+
+	if(src->arena != a) {
+		arena_adopt(a,src->arena);
+		src->arena = a;
+	}
+
+	g_hash_table_iter_init(&it,src->tts);
+	while(g_hash_table_iter_next(&it,&key,&value)) {
+		const gchar *cp = arena_strdup(a,key);
+		cp_table_insert(ctx_own_table(ctx,0),cp,strlen(cp),arena_strdup(a,value));
+	}
+	/* only lomoji_ctx_refresh() looks at it again, and without it that
+	 * just re-reads everything. */
+	if(!ctx->refreshable) {
+		g_hash_table_destroy(src->tts);
+		src->tts = NULL;
+	}
+}
+
+/* note a name or alias list from the file, for source_expand(). */
+static void source_log(lomoji_source_t *src, gchar kind, const gchar *cp, const gchar *text) {
+	g_string_append_c(src->aliases,kind);
+	g_string_append_len(src->aliases,cp,strlen(cp) + 1);
+	g_string_append_len(src->aliases,text,strlen(text) + 1);
+}
+
+/* split up the names and aliases that the file had into the source's alias
+ * tables, in the order they were in the file. */
+static void source_expand(lomoji_source_t *src) {
+	arena_t *a = src->arena;
+	const gchar *p, *end;
+
+	if(!src->aliases) return;
+
+	for(p = src->aliases->str, end = p + src->aliases->len; p < end; ) {
+		gchar kind = *p++;
+		const gchar *cp = p;
+		const gchar *text = cp + strlen(cp) + 1;
+
+		p = text + strlen(text) + 1;
+		if(kind == '=') {
+			g_hash_table_insert(src->alias_set,(gpointer)arena_strdup(a,text),(gpointer)arena_strdup(a,cp));
+			continue;
+		}
+
+		gchar **aliases = g_strsplit(text,"|",-1);
+		for(char **s = aliases; s && *s; s++) {
+			char *alias = g_strdup(g_strstrip(*s));
+			gchar *key;
+			for(gchar *c=alias;*c;c++) {
+				if(*c==' ') *c='_';
+				if(*c==':') *c='_';  /* colons too. */
+			}
+			key = g_str_to_ascii(alias,NULL);
+			/* the duplicate check is on the alias as written, so one that
+			 * isn't plain ascii always replaces. */
+			if(strcmp(key,alias) != 0) {
+				g_hash_table_insert(src->alias_set,(gpointer)arena_strdup(a,key),(gpointer)arena_strdup(a,cp));
+			} else if(!g_hash_table_contains(src->alias_add,key)) {
+				g_hash_table_insert(src->alias_add,(gpointer)arena_strdup(a,key),(gpointer)arena_strdup(a,cp));
+			}
+			g_free(key);
+			g_free(alias);
+		}
+		g_strfreev(aliases);
+	}
+	g_string_free(src->aliases,TRUE);
+	src->aliases = NULL;
+}
+
+static void lomoji_source_free(gpointer p) {
+	lomoji_source_t *src = p;
+
+	source_forget(src);
+	g_free(src->path);
+	g_free(src);
+}
+
+
+/*---- snapshots ----*/
+
+/* snapshot writer state.  Strings are pooled so that the many codepoints that
+ * appear in more than one table are only stored once. */
+struct snap_writer {
+	GString *blob;
+	GHashTable *pool;	/* string to offset+1 in blob. */
+};
+
+static guint32 snap_put_string(struct snap_writer *w, const gchar *str) {
+	gpointer off;
+
+	if( (off = g_hash_table_lookup(w->pool,str)) ) {
+		return(GPOINTER_TO_UINT(off) - 1);
+	}
+	guint32 at = w->blob->len;
+	g_string_append_len(w->blob,str,strlen(str)+1);
+	g_hash_table_insert(w->pool,(gpointer)str,GUINT_TO_POINTER(at+1));
+	return(at);
+}
+
+static void snap_pad(struct snap_writer *w) {
+	while(w->blob->len != SNAP_ALIGN(w->blob->len)) {
+		g_string_append_c(w->blob,'\0');
+	}
+}
+
+static gint snap_pair_compare(gconstpointer a, gconstpointer b) {
+	return(strcmp( ((const gchar **)a)[0], ((const gchar **)b)[0] ));
+}
+
+/* write one table, with entries in the order of slot[], or in sorted order if
+ * slot is NULL.  pairs holds key,value,key,value...  Returns the number of
+ * entries, and sets *at to the table offset. */
+static guint32 snap_put_table(struct snap_writer *w, GPtrArray *pairs, guint32 *slot, guint32 *at) {
+	guint32 n = pairs->len/2;
+	snap_entry_t *tab;
+
+	if(!slot) {
+		qsort(pairs->pdata,n,2*sizeof(gpointer),snap_pair_compare);
+	}
+
+	/* strings first, then the aligned table that points at them. */
+	tab = g_new0(snap_entry_t,n ? n : 1);
+	for(guint32 i=0;i<n;i++) {
+		guint32 p = slot ? slot[i] : i;
+		const gchar *k = pairs->pdata[2*p];
+		const gchar *v = pairs->pdata[2*p+1];
+		tab[i].key = snap_put_string(w,k);
+		tab[i].keylen = strlen(k);
+		tab[i].val = snap_put_string(w,v);
+		tab[i].vallen = strlen(v);
+	}
+	snap_pad(w);
+	*at = w->blob->len;
+	g_string_append_len(w->blob,(gchar *)tab,n*sizeof(snap_entry_t));
+	g_free(tab);
+	return(n);
+}
+
+/* Minimal perfect hashing, by hash and displace.  Every key hashes once to
+ * 64 bits.  The top half picks a bucket, and the bucket's two displacements
+ * d0,d1 turn the low bits into a slot: (f1 + d0*f2 + d1) % n.  The builder
+ * finds displacements that put every key in a slot of its own, so a lookup is
+ * one hash, one slot, and one memcmp to see if it was really that key. */
+
+#define MPH_LAMBDA 4		/* average keys per bucket. */
+#define MPH_MAX_D0 64		/* d0's to try before picking another seed. */
+#define MPH_MAX_SEEDS 32
+
+static guint64 mph_hash(const gchar *key, gsize len, guint32 seed) {
+	guint64 h = 0xcbf29ce484222325ULL ^ seed;
+
+	for(gsize i=0;i<len;i++) {
+		h ^= (guchar)key[i];
+		h *= 0x100000001b3ULL;
+	}
+	/* fnv is weak in the high bits, so mix it up. */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return(h);
+}
+
+/* the slot for hash h in a table of n entries. */
+static inline guint32 mph_slot(const snap_mph_t *mph, const guint32 *disp, guint32 n, guint64 h) {
+	guint32 b = (guint32)(h >> 32) % mph->nbuckets;
+	guint64 f1 = (guint32)h % n;
+	guint64 f2 = ((guint32)(h >> 32) / mph->nbuckets) % n;
+
+	return( (f1 + disp[2*b]*f2 + disp[2*b+1]) % n );
+}
+
+/* bucket ordering for the builder, largest first. */
+static gint mph_bucket_compare(gconstpointer a, gconstpointer b, gpointer data) {
+	const guint32 *size = data;
+	guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+
+	if(size[x] != size[y]) return((size[x] < size[y]) ? 1 : -1);
+	return((x > y) - (x < y));
+}
+
+/* find a minimal perfect hash for the n keys in pairs.  On success, returns
+ * the displacements (2 per bucket) and fills in mph and slot[], which gives
+ * the pair index that belongs in each slot.  Returns NULL if no hash could
+ * be found, which shouldn't happen outside of duplicate keys. */
+static guint32 *mph_build(GPtrArray *pairs, snap_mph_t *mph, guint32 *slot) {
+	guint32 n = pairs->len/2;
+	guint32 nb = n/MPH_LAMBDA + 1;
+	guint64 *hash = g_new(guint64,n ? n : 1);
+	guint32 *size = g_new(guint32,nb);
+	guint32 *first = g_new(guint32,nb+1);
+	guint32 *member = g_new(guint32,n ? n : 1);
+	guint32 *order = g_new(guint32,nb);
+	guint32 *disp = g_new(guint32,2*nb);
+	guchar *taken = g_new(guchar,n ? n : 1);
+	guint32 *tried = g_new(guint32,MPH_LAMBDA*8);
+	int found = 0;
+
+	mph->nbuckets = nb;
+
+	for(guint32 seed=1; seed<=MPH_MAX_SEEDS && !found; seed++) {
+		mph->seed = seed;
+		memset(size,0,nb*sizeof(guint32));
+		memset(disp,0,2*nb*sizeof(guint32));
+		memset(taken,0,n ? n : 1);
+
+		/* sort the keys into their buckets. */
+		for(guint32 i=0;i<n;i++) {
+			const gchar *k = pairs->pdata[2*i];
+			hash[i] = mph_hash(k,strlen(k),seed);
+			size[(guint32)(hash[i] >> 32) % nb]++;
+		}
+		first[0] = 0;
+		for(guint32 b=0;b<nb;b++) {
+			first[b+1] = first[b] + size[b];
+			order[b] = b;
+		}
+		for(guint32 i=0;i<n;i++) {
+			guint32 b = (guint32)(hash[i] >> 32) % nb;
+			member[first[b+1] - size[b]--] = i;
+		}
+		for(guint32 b=0;b<nb;b++) {
+			size[b] = first[b+1] - first[b];
+		}
+		g_qsort_with_data(order,nb,sizeof(guint32),mph_bucket_compare,size);
+
+		/* place the biggest buckets first, while there's room. */
+		found = 1;
+		for(guint32 o=0;o<nb && found;o++) {
+			guint32 b = order[o];
+			guint32 k = size[b];
+			int placed = 0;
+
+			if(k == 0) break;
+			if(k > MPH_LAMBDA*8) {
+				found = 0;
+				break;
+			}
+
+			for(guint32 d0=0; d0<MPH_MAX_D0 && !placed; d0++) {
+				for(guint32 d1=0; d1<n && !placed; d1++) {
+					guint32 j;
+					disp[2*b] = d0;
+					disp[2*b+1] = d1;
+					for(j=0;j<k;j++) {
+						guint32 s = mph_slot(mph,disp,n,hash[member[first[b]+j]]);
+						if(taken[s]) break;
+						taken[s] = 1;
+						tried[j] = s;
+					}
+					if(j == k) {
+						placed = 1;
+					} else {
+						/* back out the ones that did fit. */
+						while(j-- > 0) taken[tried[j]] = 0;
+					}
+				}
+			}
+			if(!placed) {
+				found = 0;
+				break;
+			}
+			for(guint32 j=0;j<k;j++) {
+				slot[tried[j]] = member[first[b]+j];
+			}
+		}
+	}
+
+	g_free(hash);
+	g_free(size);
+	g_free(first);
+	g_free(member);
+	g_free(order);
+	g_free(taken);
+	g_free(tried);
+
+	if(!found) {
+		g_free(disp);
+		return(NULL);
+	}
+	return(disp);
+}
+
+/* write a hashed table: its entries in slot order, and its displacements. */
+static int snap_put_hashed(struct snap_writer *w, GPtrArray *pairs, guint32 *at, guint32 *count, snap_mph_t *mph) {
+	guint32 n = pairs->len/2;
+	guint32 *slot = g_new(guint32,n ? n : 1);
+	guint32 *disp;
+
+	memset(mph,0,sizeof(*mph));
+	if( !(disp = mph_build(pairs,mph,slot)) ) {
+		g_free(slot);
+		return(0);
+	}
+	*count = snap_put_table(w,pairs,slot,at);
+	snap_pad(w);
+	mph->buckets = w->blob->len;
+	g_string_append_len(w->blob,(gchar *)disp,2*mph->nbuckets*sizeof(guint32));
+	g_free(disp);
+	g_free(slot);
+	return(1);
+}
+
+/* write the single codepoint part of a table. */
+static void snap_put_cpmap(struct snap_writer *w, lomoji_ctx_t *ctx, int equiv, snap_cpmap_t *sec) {
+	guint16 *dir = g_new0(guint16,CP_PAGES);
+	guint32 *vals = g_new0(guint32,CP_PAGE_SIZE);	/* page 0 stays empty. */
+	guint32 npages = 1;
+
+	memset(sec,0,sizeof(*sec));
+	for(guint32 p=0;p<CP_PAGES;p++) {
+		guint32 *page;
+		int used = 0;
+
+		if(!ctx_single_page_used(ctx,equiv,p)) continue;
+
+		vals = g_renew(guint32,vals,(npages+1)*CP_PAGE_SIZE);
+		page = vals + npages*CP_PAGE_SIZE;
+		for(guint32 o=0;o<CP_PAGE_SIZE;o++) {
+			const gchar *v = ctx_lookup_single(ctx,equiv,(p << CP_PAGE_BITS) | o);
+			page[o] = v ? snap_put_string(w,v) : 0;
+			if(v) {
+				used = 1;
+				sec->count++;
+			}
+		}
+		if(used) {
+			dir[p] = npages++;
+		}
+	}
+
+	snap_pad(w);
+	sec->dir = w->blob->len;
+	g_string_append_len(w->blob,(gchar *)dir,CP_PAGES*sizeof(guint16));
+	snap_pad(w);
+	sec->pages = w->blob->len;
+	sec->npages = npages;
+	g_string_append_len(w->blob,(gchar *)vals,npages*CP_PAGE_SIZE*sizeof(guint32));
+	g_free(dir);
+	g_free(vals);
+}
+
+/* write a sequence trie.  The nodes don't refer to anything else, so they are
+ * copied as they are. */
+/* write a trie out breadth first, so that every child and sibling link points
+ * at a later node than the one it's in, which snap_trie_ok() checks for. */
+static void snap_put_trie(struct snap_writer *w, const trie_node_t *nodes, guint32 n, snap_trie_t *sec) {
+	trie_node_t *out = g_new0(trie_node_t,n ? n : 1);
+	guint32 *order = g_new(guint32,n ? n : 1);	/* where each node came from. */
+	guint32 done = 0, queued = 0;
+
+	if(n) order[queued++] = 0;
+	while(done < queued) {
+		guint32 i = done++;
+
+		out[i] = nodes[order[i]];
+		/* a node's siblings are queued right after it. */
+		out[i].sibling = nodes[order[i]].sibling ? i+1 : 0;
+		if(nodes[order[i]].child) {
+			out[i].child = queued;
+			for(guint32 c = nodes[order[i]].child; c; c = nodes[c].sibling) {
+				order[queued++] = c;
+			}
+		}
+	}
+
+	snap_pad(w);
+	sec->nodes = w->blob->len;
+	sec->count = queued;
+	g_string_append_len(w->blob,(const gchar *)out,queued*sizeof(trie_node_t));
+	g_free(order);
+	g_free(out);
+}
+
+/* gather a table's contents as key,value pairs from either form. */
+static GPtrArray *snap_pairs(lomoji_ctx_t *ctx, GHashTable *live, const snap_entry_t *tab, guint32 n) {
+	GPtrArray *pairs = g_ptr_array_new();
+
+	if(ctx->snap) {
+		for(guint32 i=0;i<n;i++) {
+			if(!snap_entry_ok(ctx->snap,tab+i)) continue;
+			g_ptr_array_add(pairs,(gpointer)(ctx->snap->base + tab[i].key));
+			g_ptr_array_add(pairs,(gpointer)(ctx->snap->base + tab[i].val));
+		}
+	} else {
+		GHashTableIter iter;
+		gpointer k,v;
+		g_hash_table_iter_init(&iter,live);
+		while(g_hash_table_iter_next(&iter,&k,&v)) {
+			g_ptr_array_add(pairs,(gpointer)((lomoji_slice_t *)k)->str);
+			g_ptr_array_add(pairs,v);
+		}
+	}
+	return(pairs);
+}
+
+/* a checksum of a header, taken with its check field zeroed. */
+static guint32 snap_header_check(const snap_header_t *hdr) {
+	snap_header_t h = *hdr;
+
+	h.check = 0;
+	return((guint32)mph_hash((const gchar *)&h,sizeof(h),SNAP_BOM));
+}
+
+/* compile a context into a snapshot image.  Returns NULL if it can't. */
+static GString *snap_build(lomoji_ctx_t *ctx) {
+	struct snap_writer w;
+	snap_header_t hdr;
+	snap_source_t *srcs;
+	GPtrArray *pairs;
+	alias_cursor c;
+	int ok;
+
+	/* an overlay's tables are only part of what it translates with. */
+	if(ctx->base) return(NULL);
+
+	memset(&hdr,0,sizeof(hdr));
+	w.blob = g_string_sized_new(1<<16);
+	w.pool = g_hash_table_new(g_str_hash,g_str_equal);
+
+	/* room for the header, filled in at the end. */
+	g_string_append_len(w.blob,(gchar *)&hdr,sizeof(hdr));
+
+	hdr.prefix = snap_put_string(&w,ctx->tts_prefix);
+	hdr.suffix = snap_put_string(&w,ctx->tts_suffix);
+	hdr.unknown = snap_put_string(&w,ctx->unknown);
+
+	/* the source list. */
+	hdr.nsources = ctx->sources->len;
+	srcs = g_new0(snap_source_t,hdr.nsources ? hdr.nsources : 1);
+	for(guint i=0;i<ctx->sources->len;i++) {
+		lomoji_source_t *src = g_ptr_array_index(ctx->sources,i);
+		srcs[i].path = snap_put_string(&w,src->path);
+		srcs[i].mtime = src->mtime;
+		srcs[i].size = src->size;
+	}
+	snap_pad(&w);
+	hdr.sources = w.blob->len;
+	g_string_append_len(w.blob,(gchar *)srcs,hdr.nsources*sizeof(snap_source_t));
+	g_free(srcs);
+
+	/* the tables. */
+	pairs = snap_pairs(ctx,ctx->snap ? NULL : ctx->cp_tts->seq,
+		ctx->snap ? ctx->snap->tts : NULL, ctx->snap ? ctx->snap->hdr->ntts : 0);
+	ok = snap_put_hashed(&w,pairs,&hdr.tts,&hdr.ntts,&hdr.tts_mph);
+	g_ptr_array_free(pairs,TRUE);
+	snap_put_cpmap(&w,ctx,0,&hdr.tts_cp);
+	if(ctx->snap) {
+		snap_put_trie(&w,ctx->snap->tts_trie,ctx->snap->hdr->tts_trie.count,&hdr.tts_trie);
+	} else {
+		snap_put_trie(&w,(trie_node_t *)ctx->cp_tts->trie->data,ctx->cp_tts->trie->len,&hdr.tts_trie);
+	}
+
+	pairs = snap_pairs(ctx,ctx->snap ? NULL : ctx->cp_equiv->seq,
+		ctx->snap ? ctx->snap->equiv : NULL, ctx->snap ? ctx->snap->hdr->nequiv : 0);
+	ok = ok && snap_put_hashed(&w,pairs,&hdr.equiv,&hdr.nequiv,&hdr.equiv_mph);
+	g_ptr_array_free(pairs,TRUE);
+	snap_put_cpmap(&w,ctx,1,&hdr.equiv_cp);
+	if(ctx->snap) {
+		snap_put_trie(&w,ctx->snap->equiv_trie,ctx->snap->hdr->equiv_trie.count,&hdr.equiv_trie);
+	} else {
+		snap_put_trie(&w,(trie_node_t *)ctx->cp_equiv->trie->data,ctx->cp_equiv->trie->len,&hdr.equiv_trie);
+	}
+
+	/* the packed index decodes keys into the cursor, so these are copies. */
+	pairs = g_ptr_array_new_with_free_func(g_free);
+	for(alias_seek(ctx,&c,"");alias_key(&c);alias_next(&c)) {
+		g_ptr_array_add(pairs,g_strdup(alias_key(&c)));
+		g_ptr_array_add(pairs,g_strdup(alias_value(&c)));
+	}
+	hdr.nalias = snap_put_table(&w,pairs,NULL,&hdr.alias);
+	ok = ok && snap_put_hashed(&w,pairs,&hdr.exact,&hdr.nexact,&hdr.exact_mph);
+	g_ptr_array_free(pairs,TRUE);
+
+	g_hash_table_destroy(w.pool);
+
+	/* end on a nul. */
+	g_string_append_c(w.blob,'\0');
+	snap_pad(&w);
+
+	if(!ok || w.blob->len > G_MAXUINT32) {
+		fprintf(stderr,"lomoji: Couldn't build a snapshot of the context.\n");
+		g_string_free(w.blob,TRUE);
+		return(NULL);
+	}
+
+	memcpy(hdr.magic,SNAP_MAGIC,sizeof(hdr.magic));
+	hdr.bom = SNAP_BOM;
+	hdr.version = SNAP_VERSION;
+	hdr.size = w.blob->len;
+	hdr.check = snap_header_check(&hdr);
+	memcpy(w.blob->str,&hdr,sizeof(hdr));
+
+	return(w.blob);
+}
+
+int lomoji_ctx_save(lomoji_ctx_t *ctx, const char *path) {
+	GString *blob;
+	gchar *tmpname;
+	int fd;
+	gsize done;
+
+	if(!ctx || !path) return((errno = EPERM));
+
+	if( !(blob = snap_build(ctx)) ) {
+		return((errno = EINVAL));
+	}
+
+	/* write to a temp file and rename it into place, so that anyone who has
+	 * the old snapshot mapped keeps a consistent view of it. */
+	tmpname = g_strdup_printf("%s.XXXXXX",path);
+	if((fd = mkstemp(tmpname)) == -1) {
+		int err = errno;
+		fprintf(stderr,"lomoji: Couldn't create '%s': %s\n",tmpname,strerror(err));
+		g_free(tmpname);
+		g_string_free(blob,TRUE);
+		return((errno = err));
+	}
+
+	for(done = 0; done < blob->len; ) {
+		ssize_t wrote = write(fd,blob->str + done,blob->len - done);
+		if(wrote <= 0) break;
+		done += wrote;
+	}
+
+	errno = 0;
+	if(done != blob->len || fchmod(fd,0644) || close(fd) || rename(tmpname,path)) {
+		int err = errno ? errno : EIO;
+		fprintf(stderr,"lomoji: Couldn't write '%s': %s\n",path,strerror(err));
+		unlink(tmpname);
+		g_free(tmpname);
+		g_string_free(blob,TRUE);
+		return((errno = err));
+	}
+	g_free(tmpname);
+	g_string_free(blob,TRUE);
+	return(0);
+}
+
+int lomoji_ctx_freeze(lomoji_ctx_t *ctx) {
+	struct lomoji_snap_s *s;
+	GString *blob;
+
+	if(!ctx) return((errno = EPERM));
+
+	/* already read-only. */
+	if(ctx->snap) return(0);
+	/* overlays are reading the tables, and the strings. */
+	if(g_atomic_int_get(&ctx->overlays)) return((errno = EBUSY));
+
+	if( !(blob = snap_build(ctx)) ) {
+		return((errno = EINVAL));
+	}
+
+	s = g_new0(struct lomoji_snap_s,1);
+	s->refs = 1;
+	s->size = blob->len;
+	s->base = g_string_free(blob,FALSE);
+	s->mapped = FALSE;
+	snap_attach(s);
+
+	cp_table_free(ctx->cp_tts);
+	cp_table_free(ctx->cp_equiv);
+	if(ctx->alias_cp) g_tree_destroy(ctx->alias_cp);
+	alias_ix_free(ctx->alias_ix);
+	ctx->cp_tts = NULL;
+	ctx->cp_equiv = NULL;
+	ctx->alias_cp = NULL;
+	ctx->alias_ix = NULL;
+	ctx->snap = s;
+	arena_free(ctx->arena);
+	ctx->arena = NULL;
+
+	/* lomoji_ctx_refresh() starts over on a frozen context anyway. */
+	for(guint i=0;i<ctx->sources->len;i++) {
+		source_forget(g_ptr_array_index(ctx->sources,i));
+	}
+	return(0);
+}
+
+/* let go of a snapshot, which goes with the last context reading it. */
+static void snap_unmap(struct lomoji_snap_s *snap) {
+	if(!snap) return;
+	if(!g_atomic_int_dec_and_test(&snap->refs)) return;
+	if(snap->mapped) {
+		munmap((void *)snap->base,snap->size);
+	} else {
+		g_free((gpointer)snap->base);
+	}
+	g_free(snap);
+}
+
+/* point at the tables of a checked snapshot. */
+static void snap_attach(struct lomoji_snap_s *s) {
+	const snap_header_t *hdr = s->hdr = (const snap_header_t *)s->base;
+
+	s->tts = (const snap_entry_t *)(s->base + hdr->tts);
+	s->equiv = (const snap_entry_t *)(s->base + hdr->equiv);
+	s->alias = (const snap_entry_t *)(s->base + hdr->alias);
+	s->tts_disp = (const guint32 *)(s->base + hdr->tts_mph.buckets);
+	s->equiv_disp = (const guint32 *)(s->base + hdr->equiv_mph.buckets);
+	s->tts_dir = (const guint16 *)(s->base + hdr->tts_cp.dir);
+	s->tts_pages = (const guint32 *)(s->base + hdr->tts_cp.pages);
+	s->equiv_dir = (const guint16 *)(s->base + hdr->equiv_cp.dir);
+	s->equiv_pages = (const guint32 *)(s->base + hdr->equiv_cp.pages);
+	s->tts_trie = (const trie_node_t *)(s->base + hdr->tts_trie.nodes);
+	s->equiv_trie = (const trie_node_t *)(s->base + hdr->equiv_trie.nodes);
+	s->exact = (const snap_entry_t *)(s->base + hdr->exact);
+	s->exact_disp = (const guint32 *)(s->base + hdr->exact_mph.buckets);
+}
+
+/* is [off,off+len) inside the mapped snapshot? */
+static int snap_inbounds(struct lomoji_snap_s *s, guint64 off, guint64 len) {
+	return(off <= s->size && len <= s->size - off);
+}
+
+/* checks that a table is there.  Its entries are checked by snap_entry_ok()
+ * as they're read, so that opening a snapshot doesn't read all of it. */
+static int snap_table_ok(struct lomoji_snap_s *s, guint32 at, guint32 n) {
+	return(at % 8 == 0 && snap_inbounds(s,at,(guint64)n*sizeof(snap_entry_t)));
+}
+
+/* and that a hashed table's displacements are there. */
+static int snap_mph_ok(struct lomoji_snap_s *s, const snap_mph_t *mph) {
+	return( mph->nbuckets > 0 && mph->buckets % 8 == 0 &&
+		snap_inbounds(s,mph->buckets,(guint64)mph->nbuckets*2*sizeof(guint32))
+	);
+}
+
+static int snap_string_ok(struct lomoji_snap_s *s, guint32 at) {
+	return(at < s->size && memchr(s->base + at,'\0',s->size - at) != NULL);
+}
+
+/* and that a trie's links stay inside it and only ever point forwards, with
+ * siblings in ascending byte order, so that a walk down it always ends. */
+static int snap_trie_ok(struct lomoji_snap_s *s, const snap_trie_t *sec) {
+	const trie_node_t *nodes;
+
+	if(sec->nodes % 8 || !snap_inbounds(s,sec->nodes,(guint64)sec->count*sizeof(trie_node_t))) {
+		return(0);
+	}
+	nodes = (const trie_node_t *)(s->base + sec->nodes);
+	for(guint32 i=0;i<sec->count;i++) {
+		guint32 child = nodes[i].child, sibling = nodes[i].sibling;
+
+		if(child && (child <= i || child >= sec->count)) return(0);
+		if(sibling && (sibling <= i || sibling >= sec->count || nodes[sibling].byte <= nodes[i].byte)) {
+			return(0);
+		}
+	}
+	return(1);
+}
+
+/* and that a single codepoint array's directory only points at pages that
+ * are there.  The offsets in the pages are checked by snap_cp_lookup(). */
+static int snap_cpmap_ok(struct lomoji_snap_s *s, const snap_cpmap_t *sec) {
+	const guint16 *dir;
+
+	if( sec->dir % 8 || sec->pages % 8 || sec->npages == 0 ||
+		!snap_inbounds(s,sec->dir,CP_PAGES*sizeof(guint16)) ||
+		!snap_inbounds(s,sec->pages,(guint64)sec->npages*CP_PAGE_SIZE*sizeof(guint32))
+	) {
+		return(0);
+	}
+	dir = (const guint16 *)(s->base + sec->dir);
+	for(guint32 p=0;p<CP_PAGES;p++) {
+		if(dir[p] >= sec->npages) return(0);
+	}
+	return(1);
+}
+
+lomoji_ctx_t *lomoji_ctx_open_snapshot(const char *path) {
+	struct lomoji_snap_s *s;
+	const snap_header_t *hdr;
+	const snap_source_t *srcs;
+	lomoji_ctx_t *new;
+	struct stat st;
+	void *map;
+	int fd;
+	int stale = 0;
+
+	if(!path) {
+		errno = EPERM;
+		return(NULL);
+	}
+
+	if((fd = open(path,O_RDONLY))==-1) {
+		return(NULL);
+	}
+	if(fstat(fd,&st) || st.st_size < (off_t)sizeof(snap_header_t) || st.st_size > G_MAXUINT32) {
+		close(fd);
+		errno = EINVAL;
+		return(NULL);
+	}
+	map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		return(NULL);
+	}
+
+	s = g_new0(struct lomoji_snap_s,1);
+	s->refs = 1;
+	s->base = map;
+	s->size = st.st_size;
+	s->mapped = TRUE;
+	s->hdr = hdr = map;
+
+	/* the stable part of the header has to make sense, or there's nothing to
+	 * fall back on. */
+	if( memcmp(hdr->magic,SNAP_MAGIC,sizeof(hdr->magic)) ||
+		hdr->bom != SNAP_BOM ||
+		hdr->size != s->size ||
+		hdr->sources % 8 ||
+		!snap_inbounds(s,hdr->sources,(guint64)hdr->nsources*sizeof(snap_source_t)) ||
+		!snap_string_ok(s,hdr->prefix) ||
+		!snap_string_ok(s,hdr->suffix) ||
+		!snap_string_ok(s,hdr->unknown)
+	) {
+		fprintf(stderr,"lomoji: '%s' is not a snapshot file.\n",path);
+		snap_unmap(s);
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	srcs = (const snap_source_t *)(s->base + hdr->sources);
+	for(guint32 i=0;i<hdr->nsources;i++) {
+		gint64 mtime, size;
+		if(!snap_string_ok(s,srcs[i].path)) {
+			snap_unmap(s);
+			errno = EINVAL;
+			return(NULL);
+		}
+		source_stat(s->base + srcs[i].path,&mtime,&size);
+		if(mtime != srcs[i].mtime || size != srcs[i].size) {
+			stale = 1;
+		}
+	}
+
+	if(hdr->version != SNAP_VERSION ||
+		hdr->check != snap_header_check(hdr) ||
+		s->base[s->size-1] != '\0' ||
+		!snap_table_ok(s,hdr->tts,hdr->ntts) ||
+		!snap_table_ok(s,hdr->equiv,hdr->nequiv) ||
+		!snap_table_ok(s,hdr->alias,hdr->nalias) ||
+		!snap_table_ok(s,hdr->exact,hdr->nexact) ||
+		!snap_mph_ok(s,&hdr->tts_mph) ||
+		!snap_mph_ok(s,&hdr->exact_mph) ||
+		!snap_mph_ok(s,&hdr->equiv_mph) ||
+		!snap_cpmap_ok(s,&hdr->tts_cp) ||
+		!snap_cpmap_ok(s,&hdr->equiv_cp) ||
+		!snap_trie_ok(s,&hdr->tts_trie) ||
+		!snap_trie_ok(s,&hdr->equiv_trie)
+	) {
+		stale = 1;
+	}
+
+	if(stale) {
+		/* rebuild from the xml the snapshot was made from. */
+		char **paths = g_new0(char *,hdr->nsources+1);
+		for(guint32 i=0;i<hdr->nsources;i++) {
+			paths[i] = (char *)(s->base + srcs[i].path);
+		}
+		new = lomoji_ctx_new(hdr->nsources ? paths : NULL);
+		lomoji_set_param_ext(new,LOMOJI_PREFIX,s->base + hdr->prefix);
+		lomoji_set_param_ext(new,LOMOJI_SUFFIX,s->base + hdr->suffix);
+		lomoji_set_param_ext(new,LOMOJI_UNKNOWN,s->base + hdr->unknown);
+		g_free(paths);
+		snap_unmap(s);
+		/* tell the caller the snapshot wants saving again. */
+		if(new) errno = ESTALE;
+		return(new);
+	}
+
+	snap_attach(s);
+
+	new = ctx_alloc(s->base + hdr->prefix,s->base + hdr->suffix,s->base + hdr->unknown);
+	new->snap = s;
+
+	for(guint32 i=0;i<hdr->nsources;i++) {
+		lomoji_source_t *src = g_new0(lomoji_source_t,1);
+		src->path = g_strdup(s->base + srcs[i].path);
+		src->mtime = srcs[i].mtime;
+		src->size = srcs[i].size;
+		g_ptr_array_add(new->sources,src);
+	}
+	new->alias_from = new->sources->len;
+
+	errno = 0;
+	return(new);
+}
+
+
+/* look for an ascii equivalent char. */
+int filter_equiv_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	const gchar *sub;
+	if( (sub = ctx_lookup_equiv(ctx,check,len)) ) { 
+		(*out) = g_string_append((*out),sub);
+		return(1);
+	}
+	return(0);
+}
+
+/* look for a name. */
+int filter_toname_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	const gchar *sub;
+	if( (sub = ctx_lookup_tts(ctx,check,len)) ) {
+		/* a substitution was found. */
+		if( (sub[0] == '\0' || sub[1] == '\0') ) {
+			/* if the substitution is a single character, don't bother
+			 * wrapping it. */
+			*out = g_string_append(*out,sub);
+			return(1);
+		} else {
+			*out = g_string_append(*out,ctx->tts_prefix);
+			*out = g_string_append(*out,sub);
+			*out = g_string_append(*out,ctx->tts_suffix);
+			return(1);
+		} 
+	}
+	return(0);
+}
+
+/* look for a :emoji: type name, and emit the grapheme if found. */
+int filter_fromname_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	alias_cursor node;
+	const gchar *k, *v, *stopat;
+	gsize prefixlen = strlen(ctx->tts_prefix);
+	gsize suffixlen = strlen(ctx->tts_suffix);
+	gchar buf[128];
+	gchar *keypart;
+	gsize keylen;
+	int ret = 0;
+
+	/* the name MUST start with the tts_prefix, and MAY end with the
+	 * tts_suffix, neither of which are part of the key. */
+	if(len < prefixlen || strncmp(check,ctx->tts_prefix,prefixlen) != 0) {
+		return(0);
+	}
+	keylen = len - prefixlen;
+	if(suffixlen && (stopat = g_strstr_len(check+prefixlen,keylen,ctx->tts_suffix))) {
+		keylen = stopat - (check+prefixlen);
+	}
+	if(keylen == 0) {
+		return(0);
+	}
+
+	/* most names are typed out in full. */
+	if( (v = ctx_lookup_alias(ctx,check+prefixlen,keylen)) ) {
+		*out = g_string_append(*out,v);
+		return(1);
+	}
+
+	/* the alias index wants a nul-terminated key.  Names are short, so that
+	 * can nearly always be done on the stack. */
+	keypart = (keylen < sizeof(buf)) ? buf : g_malloc(keylen+1);
+	memcpy(keypart,check+prefixlen,keylen);
+	keypart[keylen] = '\0';
+
+	/* use the first possible completion. */
+	if(alias_seek(ctx,&node,keypart)) {
+		k = alias_key(&node);
+		if(strncmp(k,keypart,keylen) == 0) {
+			/* oooh.  It worked! */
+			*out = g_string_append(*out,alias_value(&node));
+			ret = 1;
+		}
+	}
+
+	if(keypart != buf) g_free(keypart);
+	return(ret);
+}
+
+
+/* translate grapheme into \U+x notation. */
+int filter_uplus_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+	const gchar *start, *end, *stop = check + len;
+	char buf[1024];
+	gunichar c;
+	
+	for(start = check;start < stop;start=end) {
+		if( !(end = g_utf8_find_next_char(start,stop)) ) {
+			end = stop;
+		}
+		/* a character cut short comes out the way g_utf8_get_char() has
+		 * always made of one at the end of a string. */
+		c = CHAR_CUT(start,stop) ? (gunichar)-1 : g_utf8_get_char(start);
+		g_snprintf(buf,sizeof(buf),"\\U+%x ",c);
+		*out = g_string_append(*out,buf);
+	}
+	return(1);
+}
+
+/* look for an ascii equivalent char. */
+int filter_unknown_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	*out = g_string_append(*out,ctx->unknown);
+	return(1);
+}
+
+/* Try taking the grapheme apart, into the longest known sequences or else
+ * codepoint by codepoint. */
+int filter_decompose_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	const gchar *start, *end, *stop = check + len;
+	gsize known;
+
+	for(start = check;start < stop;start=end) {
+		if( (known = ctx_match_tts(ctx,start,stop)) ) {
+			end = start + known;
+		} else if( !(end = g_utf8_find_next_char(start,stop)) ) {
+			end = stop;
+		}
+		if( filter_toname_n(ctx,start,end-start,out) == 0 ) {
+			filter_unknown_n(ctx,start,end-start,out);
+		}
+	}
+	return(1);
+}
+
+/* use glib's built in inconv based str_to_ascii() */
+int filter_iconv_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out) {
+
+	gchar *nulled, *sub;
+	nulled = g_strndup(check,len);
+	sub = g_str_to_ascii(nulled,NULL);
+	*out = g_string_append(*out,sub);
+	g_free(sub);
+	g_free(nulled);
+
+	return(1);
+}
+
+/* The original nul-terminated forms of the builtin filters. */
+int filter_equiv(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_equiv_n(ctx,check,strlen(check),out));
+}
+int filter_toname(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_toname_n(ctx,check,strlen(check),out));
+}
+int filter_fromname(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_fromname_n(ctx,check,strlen(check),out));
+}
+int filter_uplus(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_uplus_n(ctx,check,strlen(check),out));
+}
+int filter_unknown(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_unknown_n(ctx,check,strlen(check),out));
+}
+int filter_decompose(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_decompose_n(ctx,check,strlen(check),out));
+}
+int filter_iconv(lomoji_ctx_t *ctx, gchar *check, GString **out) {
+	return(filter_iconv_n(ctx,check,strlen(check),out));
+}
+
+/* the context's memo, made the first time it's needed.  Translating threads
+ * may get here at the same time on a published context, so only one of them
+ * gets to put theirs in. */
+static memo_t *ctx_memo(lomoji_ctx_t *ctx) {
+	memo_t *m;
+
+	if( (m = g_atomic_pointer_get(&ctx->memo)) ) return(m);
+
+	m = g_new0(memo_t,1);
+	g_mutex_init(&m->lock);
+	if(!g_atomic_pointer_compare_and_exchange(&ctx->memo,NULL,m)) {
+		memo_free(m);
+		m = g_atomic_pointer_get(&ctx->memo);
+	}
+	return(m);
+}
+
+static void memo_clear(memo_t *m) {
+	if(!m) return;
+	g_mutex_lock(&m->lock);
+	memset(m->slot,0,sizeof(m->slot));
+	g_mutex_unlock(&m->lock);
+}
+
+static void memo_free(memo_t *m) {
+	if(!m) return;
+	g_mutex_clear(&m->lock);
+	g_free(m);
+}
+
+/* the context whose memo builtin filter b can use with ctx.  An overlay makes
+ * the same of a grapheme as its base does, unless the filter looks at names
+ * and the overlay has names or markers of its own, so it shares its base's. */
+static lomoji_ctx_t *memo_owner(lomoji_ctx_t *ctx, guint b) {
+	while(ctx->base) {
+		if(builtin_filters[b].memo == MEMO_NAMED && (ctx->cp_tts ||
+			strcmp(ctx->tts_prefix,ctx->base->tts_prefix) ||
+			strcmp(ctx->tts_suffix,ctx->base->tts_suffix) ||
+			strcmp(ctx->unknown,ctx->base->unknown))) break;
+		ctx = ctx->base;
+	}
+	return(ctx);
+}
+
+/* run builtin filter number b over a grapheme, or copy out what it made of
+ * the same grapheme last time. */
+static int memo_filter(lomoji_ctx_t *ctx, guint b, const gchar *check, gsize len, GString **out) {
+	memo_t *m = ctx_memo(memo_owner(ctx,b));
+	guint32 h = (guint32)cache_hash(check,len) ^ (b * 0x9e3779b9U);
+	memo_slot_t *s = &m->slot[h & (MEMO_SLOTS-1)];
+	gsize was;
+	int ret;
+
+	g_mutex_lock(&m->lock);
+	if(s->which == b+1 && s->hash == h && s->keylen == len && memcmp(s->key,check,len) == 0) {
+		*out = g_string_append_len(*out,s->val,s->vallen);
+		ret = s->ret;
+		g_mutex_unlock(&m->lock);
+		return(ret);
+	}
+	g_mutex_unlock(&m->lock);
+
+	was = (*out)->len;
+	ret = builtin_filters[b].fn(ctx,check,len,out);
+	if((*out)->len - was > MEMO_VALMAX) {
+		return(ret);
+	}
+
+	g_mutex_lock(&m->lock);
+	s->which = b+1;
+	s->hash = h;
+	s->ret = ret;
+	s->keylen = len;
+	s->vallen = (*out)->len - was;
+	memcpy(s->key,check,len);
+	memcpy(s->val,(*out)->str + was,s->vallen);
+	g_mutex_unlock(&m->lock);
+	return(ret);
+}
+
+/* the context's names, parameters or equivalents changed, so anything that
+ * was remembered about translating with it is out of date. */
+static void ctx_changed(lomoji_ctx_t *ctx) {
+	cache_clear(ctx->cache);
+	memo_clear(ctx->memo);
+	if(ctx->pipes) g_ptr_array_set_size(ctx->pipes,0);
+}
+
+/* the table that names (or equivalents) put into ctx go in.  An overlay
+ * doesn't get one until it needs it. */
+static cp_table_t *ctx_own_table(lomoji_ctx_t *ctx, int equiv) {
+	cp_table_t **t = equiv ? &ctx->cp_equiv : &ctx->cp_tts;
+
+	if(!*t) *t = cp_table_new(ctx->arena);
+	return(*t);
+}
+
+/* the index of f in builtin_filters, or -1 if it isn't one. */
+static int builtin_index(lomoji_filter *f) {
+	for(int b=0;b<ARRAY_SIZE(builtin_filters);b++) {
+		if(builtin_filters[b].f == f) return(b);
+	}
+	return(-1);
+}
+
+/* the counted form registered for the custom filter f, or NULL. */
+static lomoji_filter_n *counted_form(lomoji_filter *f) {
+	gint n = g_atomic_int_get(&counted_count);
+
+	for(gint i=0;i<n;i++) {
+		if(counted_filters[i].f == f) return(g_atomic_pointer_get(&counted_filters[i].fn));
+	}
+	return(NULL);
+}
+
+int lomoji_filter_counted(lomoji_filter *f, lomoji_filter_n *fn) {
+	gint n = g_atomic_int_get(&counted_count);
+
+	if(!f || !fn || builtin_index(f) >= 0) return((errno = EINVAL));
+
+	for(gint i=0;i<n;i++) {
+		if(counted_filters[i].f == f) {
+			g_atomic_pointer_set(&counted_filters[i].fn,fn);
+			return(0);
+		}
+	}
+	if(n >= COUNTED_FILTERS) return((errno = ENOSPC));
+
+	counted_filters[n].f = f;
+	counted_filters[n].fn = fn;
+	g_atomic_int_set(&counted_count,n+1);
+	return(0);
+}
+
+/* Run a filter list over the counted string check.  Builtin filters are
+ * called through their counted forms, and the slow ones through the memo.
+ * So are custom filters that have a counted form registered.  Anything else
+ * gets a nul-terminated copy, made on the stack when it fits.
+ * Returns 0 if no filter made a substitution, or else which one did,
+ * counting from 1. */
+static int run_filters(lomoji_ctx_t *ctx, lomoji_filter **filters, const gchar *check, gsize len, GString **out) {
+
+	gchar buf[256];
+	gchar *nulled = NULL;
+	lomoji_filter_n *fn;
+	int submade = 0;
+	int i;
+
+	/* loop over the supplied filters until one returns a 1 */
+	for(i=0;filters[i] && !submade;i++) {
+		int b = builtin_index(filters[i]);
+
+		if(b >= 0 && builtin_filters[b].memo && len <= MEMO_KEYMAX) {
+			submade = memo_filter(ctx,b,check,len,out);
+			continue;
+		}
+		if(b >= 0) {
+			submade = builtin_filters[b].fn(ctx,check,len,out);
+			continue;
+		}
+		if( (fn = counted_form(filters[i])) ) {
+			submade = fn(ctx,check,len,out);
+			continue;
+		}
+
+		if(!nulled) {
+			nulled = (len < sizeof(buf)) ? buf : g_malloc(len+1);
+			memcpy(nulled,check,len);
+			nulled[len] = '\0';
+		}
+		submade = (filters[i])(ctx,nulled,out);
+	}
+
+	if(nulled && nulled != buf) g_free(nulled);
+	return(submade ? i : 0);
+}
+
+/* the compiled form of filters in ctx, if there is one. */
+static pipeline_t *ctx_pipeline(lomoji_ctx_t *ctx, lomoji_filter **filters) {
+	if(!ctx->pipes) return(NULL);
+
+	for(guint i=0;i<ctx->pipes->len;i++) {
+		pipeline_t *p = g_ptr_array_index(ctx->pipes,i);
+		if(p->filters == filters) return(p);
+	}
+	return(NULL);
+}
+
+static void pipeline_free(gpointer data) {
+	pipeline_t *p = data;
+
+	cp_table_free(p->table);
+	arena_free(p->arena);
+	g_free(p);
+}
+
+/* work out what the builtin filters at the head of the list make of key, and
+ * put it in the table.  When the whole list is builtin, a key that none of
+ * them substitute for comes out as itself, and that goes in too. */
+static void pipeline_add(lomoji_ctx_t *ctx, pipeline_t *p, lomoji_filter **head, int whole, const gchar *key, gsize len, GString *scratch) {
+	const lomoji_slice_t *v;
+
+	if(cp_table_lookup(p->table,key,len,cp_decode(key,len))) return;
+
+	g_string_truncate(scratch,0);
+	if(!run_filters(ctx,head,key,len,&scratch)) {
+		if(!whole) return;
+		g_string_append_len(scratch,key,len);
+	}
+	/* the length has to fit in a byte. */
+	if(scratch->len > G_MAXUINT8) return;
+
+	g_string_prepend_c(scratch,scratch->len);
+	v = arena_intern(p->arena,scratch->str,scratch->len);
+	cp_table_insert(p->table,key,len,v->str);
+}
+
+/* add every key of ctx's name (or equivalent) table to the pipeline. */
+static void pipeline_add_table(lomoji_ctx_t *ctx, pipeline_t *p, lomoji_filter **head, int whole, int equiv, GString *scratch) {
+	GPtrArray *pairs;
+	gchar utf[8];
+
+	for(guint32 pg=0;pg<CP_PAGES;pg++) {
+		if(!ctx_single_page_used(ctx,equiv,pg)) continue;
+		for(guint32 o=0;o<CP_PAGE_SIZE;o++) {
+			gunichar c = (pg << CP_PAGE_BITS) | o;
+			if(ctx_lookup_single(ctx,equiv,c)) {
+				pipeline_add(ctx,p,head,whole,utf,g_unichar_to_utf8(c,utf),scratch);
+			}
+		}
+	}
+
+	/* an overlay's sequences are in its own table and the ones under it. */
+	for(lomoji_ctx_t *t = ctx;t;t = t->base) {
+		cp_table_t *live = equiv ? t->cp_equiv : t->cp_tts;
+
+		if(!t->snap && !live) continue;
+		if(equiv) {
+			pairs = snap_pairs(t,t->snap ? NULL : live->seq,
+				t->snap ? t->snap->equiv : NULL, t->snap ? t->snap->hdr->nequiv : 0);
+		} else {
+			pairs = snap_pairs(t,t->snap ? NULL : live->seq,
+				t->snap ? t->snap->tts : NULL, t->snap ? t->snap->hdr->ntts : 0);
+		}
+		for(guint i=0;i<pairs->len;i+=2) {
+			const gchar *key = g_ptr_array_index(pairs,i);
+			pipeline_add(ctx,p,head,whole,key,strlen(key),scratch);
+		}
+		g_ptr_array_free(pairs,TRUE);
+	}
+}
+
+int lomoji_pipeline_compile(lomoji_ctx_t *ctx, lomoji_filter **filters) {
+	lomoji_filter **head;
+	pipeline_t *p;
+	GString *scratch;
+	gsize n, k;
+
+	if(!ctx || !filters) return((errno = EPERM));
+	if(ctx->published) return((errno = EBUSY));
+
+	/* only the builtin filters ahead of the first custom one can be worked
+	 * out in advance. */
+	for(n=0;filters[n];n++);
+	for(k=0;k<n && builtin_index(filters[k]) >= 0;k++);
+	if(k == 0) return((errno = EINVAL));
+
+	head = g_new(lomoji_filter *,k+1);
+	memcpy(head,filters,k*sizeof(*head));
+	head[k] = NULL;
+
+	p = g_new0(pipeline_t,1);
+	p->filters = filters;
+	p->arena = arena_new(NULL);
+	p->table = cp_table_new(p->arena);
+	scratch = g_string_new(NULL);
+
+	/* the translator only ever hands the filters a known key, or a grapheme
+	 * that isn't in either table at all. */
+	pipeline_add_table(ctx,p,head,k == n,0,scratch);
+	pipeline_add_table(ctx,p,head,k == n,1,scratch);
+
+	g_string_free(scratch,TRUE);
+	g_free(head);
+
+	if(!ctx->pipes) {
+		ctx->pipes = g_ptr_array_new_with_free_func(pipeline_free);
+	}
+	for(guint i=0;i<ctx->pipes->len;i++) {
+		if(((pipeline_t *)g_ptr_array_index(ctx->pipes,i))->filters == filters) {
+			g_ptr_array_remove_index_fast(ctx->pipes,i);
+			break;
+		}
+	}
+	g_ptr_array_add(ctx->pipes,p);
+	return(0);
+}
+
+/* run filters over a grapheme, as one lookup if it was compiled.  Returns
+ * what run_filters() would, or PIPE_HIT for the lookup. */
+static inline int pipeline_run(lomoji_ctx_t *ctx, pipeline_t *p, lomoji_filter **filters, const gchar *check, gsize len, GString **out) {
+	const gchar *v;
+
+	if(p && (v = cp_table_lookup(p->table,check,len,cp_decode(check,len)))) {
+		*out = g_string_append_len(*out,v+1,(guchar)v[0]);
+		return(PIPE_HIT);
+	}
+	return(run_filters(ctx,filters,check,len,out));
+}
+
+int lomoji_add_equiv(lomoji_ctx_t *ctx, lomoji_equiv_t *source) {
+
+	lomoji_equiv_t *e;
+	gchar *start,*end;
+	char ascii[2] = " ";
+
+	/* make sure the ctx pointer isn't null. */
+	if(!ctx) return((errno = EPERM));
+	if(ctx->published || ctx->overlays) return((errno = EBUSY));
+
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+
+	if(!source) source=default_equiv;
+
+	for(e=source;e && e->ascii;e++) {
+		for(start = e->utf;*start;start = end) {
+			end = g_utf8_find_next_char(start,NULL);
+			/* useful for finding duplicates in the entries.
+			lomoji_slice_t cp = { start, end-start };
+			gchar *dup;
+			if((dup = (gchar*) cp_table_lookup(ctx->cp_equiv,cp.str,cp.len,cp_decode(cp.str,cp.len)))) {
+				fprintf(stderr,"Duplicate codepoint: %.*s was %s\n",(int)cp.len,cp.str,dup);
+			}
+			*/
+			*ascii = e->ascii;
+			cp_table_insert(ctx_own_table(ctx,1),start,end-start,arena_strdup(ctx->arena,ascii));
+		}
+	}
+
+	alias_pack(ctx);
+	return(0);
+}
+
+
+/* regional indicator characters can be combined to make emoji flags. */
+int lomoji_add_regional(lomoji_ctx_t *ctx) {
+
+	char ascii[2] = " ";
+	char utf[8] = "";
+	char letter;
+	gunichar c;
+
+	/* make sure the ctx pointer isn't null. */
+	if(!ctx) return((errno = EPERM));
+	if(ctx->published || ctx->overlays) return((errno = EBUSY));
+
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+
+	for(letter='A';letter<='Z';letter++) {
+		c = 0x1f1e6 + (letter - 'A');
+		*ascii = letter;
+		g_unichar_to_utf8(c,utf);
+		cp_table_insert(ctx_own_table(ctx,1),utf,strlen(utf),arena_strdup(ctx->arena,ascii));
+	}
+	alias_pack(ctx);
+	return(0);
+}
+
+/* codepoints that need names, but aren't in the CLDR annotations. */
+static const struct {
+	gunichar cp;
+	char *name;
+} oneoffs[] = {
+		/* Note the duplicate entries.  If dup entries exist, user will be able
+		 * to enter :zwj: or :with:, but filter will print the last one added-
+		 * :with: since "Zero Width Joiner" makes no sense to anyone but
+		 * Unicode people. Note also that the dup's can be further overridden
+		 * by including language specific redefinitions in an annotations file,
+		 * in case you want 'with' to say 'con' or 'zwj' to say 'falegnameria a
+		 * larghezza zero'. */
+		{ 0x200d, "zwj" },
+		{ 0x200d, "with" }, /* dup */
+		{ 0xfe00, "vs1" },
+		{ 0xfe01, "vs2" },
+		{ 0xfe02, "vs3" },
+		/* Could include the unused variation selectors here, vs4-vs14, but I'm
+		 * not going to. I want them to show up as 'unknown'. -jsj */
+		{ 0xfe0e, "vs15" },
+		{ 0xfe0e, "text" }, /* dup */
+		{ 0xfe0f, "vs16" },
+		{ 0xfe0f, "emoji" } /* dup */
+};
+
+/* put the oneoffs into the live tables. */
+static void oneoffs_insert(lomoji_ctx_t *ctx) {
+	char utf[8] = "";
+
+	for(int i=0;i<ARRAY_SIZE(oneoffs);i++) {
+		g_unichar_to_utf8(oneoffs[i].cp,utf);
+		cp_table_insert(ctx_own_table(ctx,0),utf,strlen(utf),arena_strdup(ctx->arena,oneoffs[i].name));
+		g_tree_insert(ctx->alias_cp,
+			(gpointer)arena_strdup(ctx->arena,oneoffs[i].name),
+			(gpointer)arena_strdup(ctx->arena,utf)
+		);
+	}
+}
+
+/* the name the oneoffs give cp, or NULL.  Later entries win, as they do in
+ * oneoffs_insert(). */
+static const gchar *oneoffs_tts(const gchar *cp) {
+	const gchar *ret = NULL;
+	char utf[8];
+
+	for(int i=0;i<ARRAY_SIZE(oneoffs);i++) {
+		utf[g_unichar_to_utf8(oneoffs[i].cp,utf)] = '\0';
+		if(strcmp(utf,cp) == 0) ret = oneoffs[i].name;
+	}
+	return(ret);
+}
+
+/* the codepoint the oneoffs give alias, or NULL. */
+static gchar *oneoffs_alias(const gchar *alias) {
+	char utf[8];
+
+	for(int i=0;i<ARRAY_SIZE(oneoffs);i++) {
+		if(strcmp(oneoffs[i].name,alias) == 0) {
+			utf[g_unichar_to_utf8(oneoffs[i].cp,utf)] = '\0';
+			return(g_strdup(utf));
+		}
+	}
+	return(NULL);
+}
+
+void lomoji_add_oneoffs(lomoji_ctx_t *ctx) {
+
+	if(!ctx || ctx->published || ctx->overlays) return;
+
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+	alias_unpack(ctx);
+
+	oneoffs_insert(ctx);
+
+	alias_pack(ctx);
+
+}
+
+static void added_alias_free(gpointer p) {
+	added_alias_t *a = p;
+
+	g_free(a->cp);
+	g_free(a);
+}
+
+int lomoji_add_alias(lomoji_ctx_t *ctx, const char *alias, const char *cp) {
+	added_alias_t *a;
+	gchar *name, *key;
+
+	if(!ctx || !alias || !cp) return((errno = EPERM));
+	if(ctx->published || ctx->overlays) return((errno = EBUSY));
+
+	/* made into a key the same way as one from an annotations file. */
+	name = g_ascii_strdown(alias,-1);
+	g_strstrip(name);
+	for(gchar *c=name;*c;c++) {
+		if(*c==' ') *c='_';
+		if(*c==':') *c='_';  /* colons too. */
+	}
+	key = g_str_to_ascii(name,NULL);
+	g_free(name);
+	if(!*key || !*cp) {
+		g_free(key);
+		return((errno = EINVAL));
+	}
+
+	ctx_changed(ctx);
+	ctx_thaw(ctx);
+	alias_unpack(ctx);
+
+	g_tree_insert(ctx->alias_cp,
+		(gpointer)arena_strdup(ctx->arena,key),
+		(gpointer)arena_strdup(ctx->arena,cp)
+	);
+
+	/* remembered, for lomoji_ctx_refresh() to put back. */
+	if(!ctx->added) {
+		ctx->added = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,added_alias_free);
+	}
+	a = g_new(added_alias_t,1);
+	a->at = ctx->sources->len;
+	a->cp = g_strdup(cp);
+	g_hash_table_replace(ctx->added,key,a);
+
+	alias_pack(ctx);
+	return(0);
+}
+
+/* hashes the input of a translation for the cache, a word at a time. */
+static guint64 cache_hash(const gchar *s, gsize len) {
+	guint64 h = 0x9e3779b97f4a7c15ULL ^ len;
+	guint64 w;
+
+	while(len >= sizeof(w)) {
+		memcpy(&w,s,sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+		s += sizeof(w);
+		len -= sizeof(w);
+	}
+	w = 0;
+	memcpy(&w,s,len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 32;
+	return(h);
+}
+
+static guint cache_key_hash(gconstpointer key) {
+	return((guint)((const cache_key_t *)key)->hash);
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b) {
+	const cache_key_t *x = a, *y = b;
+
+	return(x->hash == y->hash && x->filters == y->filters && x->dir == y->dir &&
+		x->len == y->len && memcmp(x->in,y->in,x->len) == 0);
+}
+
+/* what an entry costs against the budget. */
+static gsize cache_cost(const cache_entry_t *e) {
+	return(sizeof(*e) + e->key.len + e->outlen);
+}
+
+static cache_t *cache_new(gsize budget) {
+	cache_t *c = g_new0(cache_t,1);
+
+	g_mutex_init(&c->lock);
+	c->map = g_hash_table_new(cache_key_hash,cache_key_equal);
+	c->ring = g_ptr_array_new_with_free_func(g_free);
+	c->budget = budget;
+	return(c);
+}
+
+/* forget everything.  Called with the lock held, or when no one else can
+ * have it. */
+static void cache_empty(cache_t *c) {
+	g_hash_table_remove_all(c->map);
+	g_ptr_array_set_size(c->ring,0);
+	c->hand = 0;
+	c->bytes = 0;
+}
+
+/* the context changed, so what was remembered may no longer be right. */
+static void cache_clear(cache_t *c) {
+	if(!c) return;
+	g_mutex_lock(&c->lock);
+	cache_empty(c);
+	g_mutex_unlock(&c->lock);
+}
+
+static void cache_free(cache_t *c) {
+	if(!c) return;
+	cache_empty(c);
+	g_hash_table_destroy(c->map);
+	g_ptr_array_free(c->ring,TRUE);
+	g_mutex_clear(&c->lock);
+	g_free(c);
+}
+
+/* make room for need more bytes, by sweeping the clock hand around and
+ * evicting the entries that haven't been used since it last came by.  Called
+ * with the lock held. */
+static void cache_evict(cache_t *c, gsize need) {
+	while(c->ring->len && c->bytes + need > c->budget) {
+		cache_entry_t *e;
+
+		if(c->hand >= c->ring->len) c->hand = 0;
+		e = g_ptr_array_index(c->ring,c->hand);
+		if(e->ref) {
+			e->ref = 0;
+			c->hand++;
+			continue;
+		}
+		c->bytes -= cache_cost(e);
+		g_hash_table_remove(c->map,&e->key);
+		/* the last entry moves into the hand's slot, and gets looked at
+		 * next. */
+		g_ptr_array_remove_index_fast(c->ring,c->hand);
+	}
+}
+
+/* appends the remembered translation for key to out, and returns TRUE if
+ * there is one. */
+static int cache_get(cache_t *c, const cache_key_t *key, GString *out) {
+	cache_entry_t *e;
+
+	g_mutex_lock(&c->lock);
+	if( (e = g_hash_table_lookup(c->map,key)) ) {
+		e->ref = 1;
+		c->hits++;
+		g_string_append_len(out,e->out,e->outlen);
+	} else {
+		c->misses++;
+	}
+	g_mutex_unlock(&c->lock);
+	return(e != NULL);
+}
+
+/* remember that key translates to [out,out+outlen).  Translations too big
+ * to be worth pushing a quarter of the cache out for aren't kept. */
+static void cache_put(cache_t *c, const cache_key_t *key, const gchar *out, gsize outlen) {
+	cache_entry_t *e;
+	gsize cost = sizeof(*e) + key->len + outlen;
+
+	if(cost > c->budget / 4) return;
+
+	e = g_malloc(cost);
+	e->key = *key;
+	e->key.in = e->bytes;
+	memcpy(e->bytes,key->in,key->len);
+	e->out = e->bytes + key->len;
+	memcpy(e->bytes + key->len,out,outlen);
+	e->outlen = outlen;
+	e->ref = 0;
+
+	g_mutex_lock(&c->lock);
+	/* another thread may have just put the same one in. */
+	if(g_hash_table_contains(c->map,&e->key)) {
+		g_mutex_unlock(&c->lock);
+		g_free(e);
+		return;
+	}
+	cache_evict(c,cost);
+	g_hash_table_insert(c->map,&e->key,e);
+	g_ptr_array_add(c->ring,e);
+	c->bytes += cost;
+	g_mutex_unlock(&c->lock);
+}
+
+int lomoji_ctx_set_cache(lomoji_ctx_t *ctx, gsize budget) {
+	if(!ctx) return((errno = EPERM));
+	if(ctx->published) return((errno = EBUSY));
+
+	if(budget == 0) {
+		cache_free(ctx->cache);
+		ctx->cache = NULL;
+	} else if(!ctx->cache) {
+		ctx->cache = cache_new(budget);
+	} else {
+		ctx->cache->budget = budget;
+		cache_evict(ctx->cache,0);
+	}
+	return(0);
+}
+
+int lomoji_ctx_cache_stats(lomoji_ctx_t *ctx, lomoji_cache_stats_t *stats) {
+	cache_t *c;
+
+	if(!ctx || !stats) return((errno = EPERM));
+
+	memset(stats,0,sizeof(*stats));
+	if( (c = ctx->cache) ) {
+		g_mutex_lock(&c->lock);
+		stats->hits = c->hits;
+		stats->misses = c->misses;
+		stats->entries = c->ring->len;
+		stats->bytes = c->bytes;
+		stats->budget = c->budget;
+		g_mutex_unlock(&c->lock);
+	}
 	return(0);
 }
 
+#ifndef LOMOJI_NO_STATS
+static void stats_release(gpointer slot);
+
+static __thread guint stats_slot;	/* this thread's shard, counting from 1. */
+static __thread guint stats_tick[2];	/* this thread's calls each way, for sampling. */
+static gint stats_taken;		/* a bit for each claimed slot. */
+static GPrivate stats_owner = G_PRIVATE_INIT(stats_release);
+
+/* a thread that has ended gives its slot back.  Its counts stay where they
+ * are, for the next thread to carry on from. */
+static void stats_release(gpointer slot) {
+	g_atomic_int_and((guint *)&stats_taken,~(1U << (GPOINTER_TO_UINT(slot) - 1)));
+}
+
+/* claim a slot for this thread, or the shared one if they're all taken. */
+static guint stats_claim(void) {
+	guint taken, slot;
+
+	do {
+		taken = (guint)g_atomic_int_get(&stats_taken);
+		if(taken == (guint)(((guint64)1 << STATS_SHARDS) - 1)) {
+			return(STATS_SHARDS + 1);
+		}
+		slot = __builtin_ctz(~taken);
+	} while(!g_atomic_int_compare_and_exchange(&stats_taken,(gint)taken,(gint)(taken | (1U << slot))));
+
+	g_private_set(&stats_owner,GUINT_TO_POINTER(slot + 1));
+	return(slot + 1);
+}
+
+static void stats_free(stats_t *st) {
+	if(!st) return;
+	if(!g_atomic_int_dec_and_test(&st->refs)) return;
+	g_mutex_clear(&st->lock);
+	g_free(st->mem);
+	g_free(st);
+}
+
+/* another reference to st, for a context that carries on counting in it. */
+static stats_t *stats_share(stats_t *st) {
+	if(st) g_atomic_int_inc(&st->refs);
+	return(st);
+}
+
+/* the context an overlay's calls are counted in: the one at the bottom of
+ * its chain, so that a few thousand overlays don't each have a set of
+ * shards. */
+static lomoji_ctx_t *stats_root(lomoji_ctx_t *ctx) {
+	while(ctx->base) ctx = ctx->base;
+	return(ctx);
+}
+
+/* the context's statistics, made the first time anything is counted. */
+static stats_t *ctx_stats(lomoji_ctx_t *ctx) {
+	stats_t *st;
+
+	if( (st = g_atomic_pointer_get(&ctx->stats)) ) return(st);
+
+	st = g_new0(stats_t,1);
+	st->refs = 1;
+	g_mutex_init(&st->lock);
+	st->mem = g_malloc0(sizeof(stats_shard_t) * (STATS_SHARDS + 1) + STATS_LINE);
+	st->shard = (stats_shard_t *)(((guintptr)st->mem + STATS_LINE - 1) & ~(guintptr)(STATS_LINE - 1));
+	if(!g_atomic_pointer_compare_and_exchange(&ctx->stats,NULL,st)) {
+		stats_free(st);
+		st = g_atomic_pointer_get(&ctx->stats);
+	}
+	return(st);
+}
+
+/* start counting a call.  Reading the clock can cost as much as a short
+ * call does, so only one call in STATS_SAMPLE is timed.  Each direction is
+ * sampled on its own, or a thread going back and forth would only ever time
+ * the one that its count happens to land on. */
+static inline void stats_start(stats_tally_t *tally, int from) {
+	memset(tally,0,sizeof(*tally));
+	if((stats_tick[from != 0]++ & (STATS_SAMPLE - 1)) == 0) {
+		struct timespec t;
+
+		clock_gettime(CLOCK_MONOTONIC,&t);
+		tally->t0 = (guint64)t.tv_sec * 1000000000ULL + t.tv_nsec;
+	}
+}
+
+/* count what took a grapheme or token, given what pipeline_run() or
+ * run_filters() made of it. */
+static inline void stats_filter(stats_tally_t *tally, lomoji_filter **filters, int hit) {
+	int which;
+
+	if(hit == PIPE_HIT) {
+		which = LOMOJI_STAT_COMPILED;
+	} else if(hit == 0) {
+		which = LOMOJI_STAT_NONE;
+	} else if( (which = builtin_index(filters[hit-1])) < 0 ) {
+		which = LOMOJI_STAT_CUSTOM;
+	}
+	tally->filtered[which]++;
+}
+
+/* add n to a shard's counter.  Nobody else writes to a thread's own shard,
+ * so a relaxed load and store is enough there. */
+static inline void stat_add(guint64 *c, guint64 n, int shared) {
+	if(shared) {
+		__atomic_fetch_add(c,n,__ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(c,__atomic_load_n(c,__ATOMIC_RELAXED) + n,__ATOMIC_RELAXED);
+	}
+}
+
+/* add a finished call into this thread's shard of ctx's statistics. */
+static void stats_call(lomoji_ctx_t *ctx, int from, gsize in, gsize out, stats_tally_t *tally) {
+	lomoji_stats_t *s;
+	guint64 *filtered;
+	int shared;
 
-/* regional indicator characters can be combined to make emoji flags. */
-int lomoji_add_regional(lomoji_ctx_t *ctx) {
+	if(!ctx) return;
 
-	char ascii[2] = " ";
-	char utf[8] = "";
-	char letter;
-	gunichar c;
+	if(!stats_slot) stats_slot = stats_claim();
+	shared = (stats_slot > STATS_SHARDS);
+	s = &ctx_stats(stats_root(ctx))->shard[stats_slot - 1].s;
 
-	/* make sure the ctx pointer isn't null. */
-	if(!ctx) return((errno = EPERM));
+	if(from) {
+		stat_add(&s->from_calls,1,shared);
+		stat_add(&s->from_bytes_in,in,shared);
+		stat_add(&s->from_bytes_out,out,shared);
+		filtered = s->from_filtered;
+	} else {
+		stat_add(&s->to_calls,1,shared);
+		stat_add(&s->to_bytes_in,in,shared);
+		stat_add(&s->to_bytes_out,out,shared);
+		if(tally->ascii_bytes) stat_add(&s->ascii_bytes,tally->ascii_bytes,shared);
+		filtered = s->to_filtered;
+	}
+	for(int i=0;i<LOMOJI_STAT_MAX;i++) {
+		if(tally->filtered[i]) stat_add(&filtered[i],tally->filtered[i],shared);
+	}
 
-	for(letter='A';letter<='Z';letter++) {
-		c = 0x1f1e6 + (letter - 'A');
-		*ascii = letter;
-		g_unichar_to_utf8(c,utf);
-		g_hash_table_insert(ctx->cp_equiv,g_strdup(utf),g_strdup(ascii));
+	if(tally->t0) {
+		struct timespec t;
+		guint64 ns;
+		guint b;
+
+		clock_gettime(CLOCK_MONOTONIC,&t);
+		ns = (guint64)t.tv_sec * 1000000000ULL + t.tv_nsec - tally->t0;
+		b = ns ? MIN(63 - __builtin_clzll(ns),LOMOJI_STATS_BUCKETS - 1) : 0;
+		if(from) {
+			stat_add(&s->from_timed,1,shared);
+			stat_add(&s->from_ns,ns,shared);
+			stat_add(&s->from_latency[b],1,shared);
+		} else {
+			stat_add(&s->to_timed,1,shared);
+			stat_add(&s->to_ns,ns,shared);
+			stat_add(&s->to_latency[b],1,shared);
+		}
 	}
-	return(0);
 }
 
-void lomoji_add_oneoffs(lomoji_ctx_t *ctx) {
+#define STATS_START(tally,from) stats_start(tally,from)
+#define STATS_FILTER(tally,filters,hit) stats_filter(tally,filters,hit)
+#define STATS_ASCII(tally,n) ((tally)->ascii_bytes += (n))
+#define STATS_CALL(ctx,from,in,out,tally) stats_call(ctx,from,in,out,tally)
 
-	char utf[8] = "";
+/* add up all of the shards.  The stats are all guint64's, so they can be
+ * added up as arrays. */
+static void stats_sum(stats_t *st, lomoji_stats_t *stats) {
+	guint64 *to = (guint64 *)stats;
 
-	struct pair {
-		gunichar cp;
-		char *name;
-	};
-	
-	struct pair addthese[] = { 
-		/* Note the duplicate entries.  If dup entries exist, user will be able
-		 * to enter :zwj: or :with:, but filter will print the last one added-
-		 * :with: since "Zero Width Joiner" makes no sense to anyone but
-		 * Unicode people. Note also that the dup's can be further overridden
-		 * by including language specific redefinitions in an annotations file,
-		 * in case you want 'with' to say 'con' or 'zwj' to say 'falegnameria a
-		 * larghezza zero'. */
-		{ 0x200d, "zwj" },
-		{ 0x200d, "with" }, /* dup */
-		{ 0xfe00, "vs1" },
-		{ 0xfe01, "vs2" },
-		{ 0xfe02, "vs3" },
-		/* Could include the unused variation selectors here, vs4-vs14, but I'm
-		 * not going to. I want them to show up as 'unknown'. -jsj */
-		{ 0xfe0e, "vs15" },
-		{ 0xfe0e, "text" }, /* dup */
-		{ 0xfe0f, "vs16" },
-		{ 0xfe0f, "emoji" } /* dup */
-	};
+	memset(stats,0,sizeof(*stats));
+	for(int i=0;i<STATS_SHARDS + 1;i++) {
+		const guint64 *from = (const guint64 *)&st->shard[i].s;
+
+		for(gsize j=0;j<sizeof(*stats)/sizeof(guint64);j++) {
+			to[j] += __atomic_load_n(&from[j],__ATOMIC_RELAXED);
+		}
+	}
+}
+
+int lomoji_ctx_stats(lomoji_ctx_t *ctx, lomoji_stats_t *stats) {
+	stats_t *st;
+
+	if(!ctx || !stats) return((errno = EPERM));
 
-	int size = (sizeof(addthese) / sizeof(struct pair));
+	memset(stats,0,sizeof(*stats));
+	if( !(st = g_atomic_pointer_get(&stats_root(ctx)->stats)) ) return(0);
 
-	for(int i=0;i<size;i++) {
-		g_unichar_to_utf8(addthese[i].cp,utf);
-		g_hash_table_insert(ctx->cp_tts,g_strdup(utf),g_strdup(addthese[i].name));
-		g_tree_insert(ctx->alias_cp,g_strdup(addthese[i].name),g_strdup(utf));
+	/* everything since the last reset. */
+	stats_sum(st,stats);
+	g_mutex_lock(&st->lock);
+	for(gsize j=0;j<sizeof(*stats)/sizeof(guint64);j++) {
+		((guint64 *)stats)[j] -= ((guint64 *)&st->base)[j];
 	}
+	g_mutex_unlock(&st->lock);
+	return(0);
+}
+
+/* the shards belong to the threads writing them, so resetting just takes
+ * note of where they are now. */
+int lomoji_ctx_stats_reset(lomoji_ctx_t *ctx) {
+	stats_t *st;
+	lomoji_stats_t now;
+
+	if(!ctx) return((errno = EPERM));
+
+	if( (st = g_atomic_pointer_get(&stats_root(ctx)->stats)) ) {
+		stats_sum(st,&now);
+		g_mutex_lock(&st->lock);
+		st->base = now;
+		g_mutex_unlock(&st->lock);
+	}
+	return(0);
+}
+#else
+static void stats_free(struct stats_s *st) {
+}
 
+static struct stats_s *stats_share(struct stats_s *st) {
+	return(NULL);
 }
 
-char *lomoji_from_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters) {
-	/* scans for tts->prefix'ed words, and runs the filter list against them. */
-	gchar *start, *end, *check;
-	char *ret;
+#define STATS_START(tally,from)
+#define STATS_FILTER(tally,filters,hit) ((void)(hit))
+#define STATS_ASCII(tally,n)
+#define STATS_CALL(ctx,from,in,out,tally)
 
-	/* no source string at all? */
-	if(!src) return(strdup("")); 
+int lomoji_ctx_stats(lomoji_ctx_t *ctx, lomoji_stats_t *stats) {
+	if(stats) memset(stats,0,sizeof(*stats));
+	return((errno = ENOSYS));
+}
 
-	/* no ctx?  Return a copy of the orginal string. */
-	if(!ctx || !filters) return(strdup(src)); 
+int lomoji_ctx_stats_reset(lomoji_ctx_t *ctx) {
+	return((errno = ENOSYS));
+}
+#endif
 
-	/* ok, start running filters. */
-	GString *out = g_string_new("");
+/* returns the number of bytes at the start of [p,stop) that are plain 7 bit
+ * ascii, checking a vector or word at a time where it can. */
+static gsize ascii_span(const gchar *p, const gchar *stop) {
+	const gchar *s = p;
+
+#if defined(__AVX2__)
+	while(stop - s >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)s);
+		guint32 hi = _mm256_movemask_epi8(v);
+		if(hi) return((s - p) + __builtin_ctz(hi));
+		s += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	while(stop - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		guint32 hi = _mm_movemask_epi8(v);
+		if(hi) return((s - p) + __builtin_ctz(hi));
+		s += 16;
+	}
+#endif
+	while(stop - s >= 8) {
+		guint64 w;
+		memcpy(&w,s,sizeof(w));
+		if(w & 0x8080808080808080ULL) break;
+		s += 8;
+	}
+	while(s < stop && !(*s & 0x80)) {
+		s++;
+	}
+	return(s - p);
+}
 
-	int prefixlen = strlen(ctx->tts_prefix);
-	int suffixlen = strlen(ctx->tts_suffix);
+/* returns the number of bytes at the start of [p,stop) that can't end a
+ * :name: token.  That is anything but ascii whitespace, a nul, the first byte
+ * of the suffix, or a non-ascii byte (which might be unicode whitespace, and
+ * gets checked the slow way.) */
+static gsize token_span(const gchar *p, const gchar *stop, gchar suffix) {
+	const gchar *s = p;
+
+#if defined(__SSE2__)
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i ff = _mm_set1_epi8('\f');
+	const __m128i sfx = _mm_set1_epi8(suffix);
+	const __m128i nul = _mm_setzero_si128();
+
+	while(stop - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		__m128i hit = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v,sp),_mm_cmpeq_epi8(v,tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(v,cr),_mm_cmpeq_epi8(v,nl))
+			),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v,ff),_mm_cmpeq_epi8(v,sfx)),
+				_mm_cmpeq_epi8(v,nul)
+			)
+		);
+		/* the movemask picks up the high bit bytes by itself. */
+		guint32 m = _mm_movemask_epi8(_mm_or_si128(hit,v));
+		if(m) return((s - p) + __builtin_ctz(m));
+		s += 16;
+	}
+#endif
+	while(s < stop) {
+		if( (*s & 0x80) || *s == suffix || *s == ' ' || *s == '\t' ||
+			*s == '\n' || *s == '\r' || *s == '\f' || *s == '\0'
+		) {
+			break;
+		}
+		s++;
+	}
+	return(s - p);
+}
 
-	for(start = src;*start;start=end) {
+/* translate :name: tokens in [src,stop) to emoji, appending to out.  Unless
+ * final is set, more text may follow stop, so this stops short of a token or
+ * prefix that more text could still change.  Returns how far it got, which is
+ * always stop when final is set.  The prefix must not be empty. */
+static const gchar *from_ascii_run(lomoji_ctx_t *ctx, lomoji_filter **filters, const gchar *src, const gchar *stop, int final, GString *out, stats_tally_t *tally) {
+	const gchar *start, *end;
+	gsize prefixlen = strlen(ctx->tts_prefix);
+	gsize suffixlen = strlen(ctx->tts_suffix);
+	int hit;
+
+	for(start = src;start < stop;start=end) {
+
+		/* skip ahead to the next byte that could start a prefix, and copy
+		 * everything before it in one go. */
+		if( !(end = memchr(start,*ctx->tts_prefix,stop-start)) ) {
+			end = stop;
+		}
+		if(end != start) {
+			out = g_string_append_len(out,start,end-start);
+			continue;
+		}
 
-		if(strncmp(start,ctx->tts_prefix,prefixlen) != 0) {
+		if((gsize)(stop-start) < prefixlen) {
+			/* the start of a prefix, maybe, with the rest still to come. */
+			if(!final && !strncmp(start,ctx->tts_prefix,stop-start)) return(start);
+			out = g_string_append_c(out,*start);
+			end = start+1;
+		} else if(strncmp(start,ctx->tts_prefix,prefixlen) != 0) {
 			/* not an ascii representation of an emoji, so just copy it in. */
 			out = g_string_append_c(out,*start);
 			end = start+1;
 		} else {
 			/* found what looks like the start of an ascii name for an emoji.
 			scan forward looking for tts_sufffix, space, EOS*/
+			int ended = 0;
+
 			end = start+prefixlen;
-			while(*end) {
-				if( (g_unichar_isspace(g_utf8_get_char(end))) ) {
+			while(end < stop) {
+				/* jump over the plain name characters. */
+				if( (end += token_span(end,stop,*ctx->tts_suffix)) >= stop) {
+					break;
+				}
+				/* a nul ends a name, like the end of the text would. */
+				if(*end == '\0') {
+					ended = 1;
+					break;
+				}
+				/* a character or a suffix that isn't all here yet. */
+				if(!final && (CHAR_CUT(end,stop) ||
+					((gsize)(stop-end) < suffixlen && !strncmp(end,ctx->tts_suffix,stop-end)))
+				) {
+					return(start);
+				}
+				if( !CHAR_CUT(end,stop) && g_unichar_isspace(g_utf8_get_char(end)) ) {
 					/* found a space. */
+					ended = 1;
 					break;
-				} else if ( !strncmp(end,ctx->tts_suffix,suffixlen )) {
+				} else if ( (gsize)(stop-end) >= suffixlen && !strncmp(end,ctx->tts_suffix,suffixlen) ) {
 					end+=suffixlen;
+					ended = 1;
 					break;
 				}
-				end = g_utf8_find_next_char(end,NULL);
+				if( !(end = g_utf8_find_next_char(end,stop)) ) {
+					end = stop;
+				}
 			}
+			/* the name might go on past stop. */
+			if(!ended && !final) return(start);
+
 			/* start and end are correct. */
-			check = g_utf8_substring(start,0,
-				g_utf8_pointer_to_offset(start,end)
-			);
-			//fprintf(stderr,"I am to check: '%s'\n",check);
+			//fprintf(stderr,"I am to check: '%.*s'\n",(int)(end-start),start);
 
-			/* loop over the supplied filters until one returns a 1 */
-			int submade = 0;
-			for(int i=0;filters[i];i++) {
-				submade = (filters[i])(ctx,check,&out);
-				if(submade) break;
-			}
-			if(!submade) {
+			if( !(hit = run_filters(ctx,filters,start,end-start,&out)) ) {
 				/* no substitution was made. */
-				out = g_string_append(out,check);
+				out = g_string_append_len(out,start,end-start);
 			}
-			g_free(check);
+			STATS_FILTER(tally,filters,hit);
 		}
 	}
-	/* strdup it instead of g_strdup() so that caller doesn't have to g_free() */
-	ret = strdup(out->str);
-	g_string_free(out,TRUE);
-	return(ret);
+	return(stop);
+}
+
+static gsize from_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out, stats_tally_t *tally) {
+	/* scans for tts->prefix'ed words, and runs the filter list against them. */
+	const gchar *stop;
+	gsize was;
+	cache_key_t key;
+	int cached = 0;
+
+	/* nowhere to put it, or no source string at all? */
+	if(!out || !src) return(0);
+
+	was = out->len;
+
+	/* no ctx?  Append a copy of the orginal string. */
+	if(!ctx || !filters) {
+		g_string_append_len(out,src,len);
+		return(out->len - was);
+	}
+
+	stop = src + len;
+
+	/* an empty prefix can't mark anything. */
+	if(!*ctx->tts_prefix) {
+		out = g_string_append_len(out,src,stop-src);
+		return(out->len - was);
+	}
+
+	/* a string without the prefix in it anywhere comes out as it went in,
+	 * and isn't worth remembering. */
+	if(ctx->cache && memchr(src,*ctx->tts_prefix,stop-src)) {
+		key = (cache_key_t){ cache_hash(src,stop-src), filters, CACHE_FROM, stop-src, src };
+		if(cache_get(ctx->cache,&key,out)) {
+			return(out->len - was);
+		}
+		cached = 1;
+	}
+
+	from_ascii_run(ctx,filters,src,stop,1,out,tally);
 
+	if(cached) cache_put(ctx->cache,&key,out->str + was,out->len - was);
+	return(out->len - was);
 }
 
-char *lomoji_to_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters) {
+gsize lomoji_from_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out) {
+	stats_tally_t tally;
+	gsize made;
+
+	STATS_START(&tally,1);
+	made = from_ascii_n(ctx,src,len,filters,out,&tally);
+	STATS_CALL(ctx,1,len,made,&tally);
+	return(made);
+}
+
+gsize lomoji_from_ascii_into(lomoji_ctx_t *ctx, const char *src, lomoji_filter **filters, GString *out) {
+	/* no source string at all? */
+	if(!src) return(0);
+	return(lomoji_from_ascii_n(ctx,src,strlen(src),filters,out));
+}
 
-	gchar *start, *end, *check;
+char *lomoji_from_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters) {
+	GString *out;
 	char *ret;
 
 	/* no source string at all? */
 	if(!src) return(strdup("")); 
 
-	/* no ctx?  no filters?  Return a copy of the orginal string. */
-	if(!ctx || !filters) return(strdup(src)); 
+	out = g_string_sized_new(strlen(src)+1);
+	lomoji_from_ascii_into(ctx,src,filters,out);
 
-	/* ok, start running filters. */
-	GString *out = g_string_new("");
+	/* strdup it instead of g_strdup() so that caller doesn't have to g_free() */
+	ret = strdup(out->str);
+	g_string_free(out,TRUE);
+	return(ret);
+}
 
-	for(start = src;*start;start=end) {
-		end = g_utf8_find_next_char(start,NULL);
+/* translate [src,stop) to ascii, appending to out.  Unless final is set,
+ * more text may follow stop, so this stops short of anything that more text
+ * could change: a sequence or a character that might not be all here yet, or
+ * a grapheme that something might still be joined on to.  Returns how far it
+ * got, which is always stop when final is set. */
+static const gchar *to_ascii_run(lomoji_ctx_t *ctx, pipeline_t *pipe, lomoji_filter **filters, const gchar *src, const gchar *stop, int final, GString *out, stats_tally_t *tally) {
+	const gchar *start, *end;
+	gsize run, known;
+	int hit;
+
+	for(start = src;start < stop;start=end) {
+		/* most text is plain ascii, which passes straight through.  The
+		 * last char of a run might start a sequence though, like a keycap,
+		 * so leave it for the sequence check. */
+		if( (run = ascii_span(start,stop)) ) {
+			if( (start + run < stop && ctx_match(ctx,start + run - 1,stop)) ||
+				(!final && ctx_match_open(ctx,start + run - 1,stop))
+			) {
+				run--;
+			}
+			if(run) {
+				out = g_string_append_len(out,start,run);
+				STATS_ASCII(tally,run);
+				end = start + run;
+				continue;
+			}
+		}
+		/* a longer sequence might turn up with more text. */
+		if(!final && ctx_match_open(ctx,start,stop)) return(start);
+
+		/* take the longest known sequence as the grapheme, when there is one,
+		 * so that skin tones, keycaps and tag sequences stay together. */
+		if( (known = ctx_match(ctx,start,stop)) ) {
+			end = start + known;
+			if( !(hit = pipeline_run(ctx,pipe,filters,start,known,&out)) ) {
+				out = g_string_append_len(out,start,known);
+			}
+			STATS_FILTER(tally,filters,hit);
+			continue;
+		}
+		if( !(end = g_utf8_find_next_char(start,stop)) ) {
+			/* the character might not be all here yet. */
+			if(!final) return(start);
+			end = stop;
+		}
 		if( (end-start)==1 && ((*start&0xc0)!=0xc0) ) {
 			/* It isn't UTF-8, so just copy it in. */
 			out = g_string_append_c(out,*start);
+			STATS_ASCII(tally,1);
 		} else {
 			/* keep pulling in zerowidth chars, and next char after that. */
-			while(g_unichar_iszerowidth(g_utf8_get_char(end))) {
-				end = g_utf8_find_next_char(end,NULL);
-				end = g_utf8_find_next_char(end,NULL);
+			for(;;) {
+				if(end >= stop || CHAR_CUT(end,stop)) {
+					/* a zerowidth char might still be on its way. */
+					if(!final) return(start);
+					break;
+				}
+				if(!g_unichar_iszerowidth(g_utf8_get_char(end))) break;
+				if( !(end = g_utf8_find_next_char(end,stop)) ) {
+					if(!final) return(start);
+					end = stop;
+					break;
+				}
+				/* nothing joins on to a nul, as if the text ended there. */
+				if(*end == '\0') break;
+				if( !(end = g_utf8_find_next_char(end,stop)) ) {
+					if(!final) return(start);
+					end = stop;
+				}
 			}
-			/* get the codepoint into its own gchar* to check. */
-			check = g_utf8_substring(start,0,
-				g_utf8_pointer_to_offset(start,end)
-			);
 
-			/* loop over the supplied filters until one returns a 1 */
-			int submade = 0;
-			for(int i=0;filters[i];i++) {
-				submade = (filters[i])(ctx,check,&out);
-				if(submade) break;
-			}
-			if(!submade) {
+			if( !(hit = pipeline_run(ctx,pipe,filters,start,end-start,&out)) ) {
 				/* no substitution was made. */
-				out = g_string_append(out,check);
+				out = g_string_append_len(out,start,end-start);
 			}
+			STATS_FILTER(tally,filters,hit);
+		}
+	}
+	return(stop);
+}
+
+static gsize to_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out, stats_tally_t *tally) {
 
-			g_free(check);
+	const gchar *stop;
+	gsize was;
+	cache_key_t key;
+	int cached = 0;
+
+	/* nowhere to put it, or no source string at all? */
+	if(!out || !src) return(0);
+
+	was = out->len;
+
+	/* no ctx?  no filters?  Append a copy of the orginal string. */
+	if(!ctx || !filters) {
+		g_string_append_len(out,src,len);
+		return(out->len - was);
+	}
+
+	stop = src + len;
+
+	/* plain ascii comes out as it went in, and isn't worth remembering. */
+	if(ctx->cache && ascii_span(src,stop) != (gsize)(stop-src)) {
+		key = (cache_key_t){ cache_hash(src,stop-src), filters, CACHE_TO, stop-src, src };
+		if(cache_get(ctx->cache,&key,out)) {
+			return(out->len - was);
 		}
+		cached = 1;
 	}
+
+	to_ascii_run(ctx,ctx_pipeline(ctx,filters),filters,src,stop,1,out,tally);
+
+	if(cached) cache_put(ctx->cache,&key,out->str + was,out->len - was);
+	return(out->len - was);
+}
+
+gsize lomoji_to_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out) {
+	stats_tally_t tally;
+	gsize made;
+
+	STATS_START(&tally,0);
+	made = to_ascii_n(ctx,src,len,filters,out,&tally);
+	STATS_CALL(ctx,0,len,made,&tally);
+	return(made);
+}
+
+gsize lomoji_to_ascii_into(lomoji_ctx_t *ctx, const char *src, lomoji_filter **filters, GString *out) {
+	/* no source string at all? */
+	if(!src) return(0);
+	return(lomoji_to_ascii_n(ctx,src,strlen(src),filters,out));
+}
+
+char *lomoji_to_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters) {
+	GString *out;
+	char *ret;
+
+	/* no source string at all? */
+	if(!src) return(strdup("")); 
+
+	out = g_string_sized_new(strlen(src)+1);
+	lomoji_to_ascii_into(ctx,src,filters,out);
+
 	/* strdup it instead of g_strdup() so that caller doesn't have to g_free() */
 	ret = strdup(out->str);
 	g_string_free(out,TRUE);
 	return(ret);
+}
+
+
+/* translate each source for each profile, doing each distinct (ctx,filters)
+ * pair only once per source.  into is lomoji_to_ascii_into() or
+ * lomoji_from_ascii_into().  If ascii_same is set, a source that is entirely
+ * plain ascii comes out as itself for any profile, so it is copied without
+ * translating at all. */
+static gsize translate_batch(
+	gsize (*into)(lomoji_ctx_t *, const char *, lomoji_filter **, GString *),
+	int ascii_same,
+	const char **src, gsize nsrc,
+	const lomoji_profile_t *profiles, gsize nprof,
+	GString **out
+) {
+	gsize *canon, *distinct, *was;
+	gsize ndistinct = 0, made = 0;
+
+	if(!src || !profiles || !out || !nprof) return(0);
+
+	/* which earlier profile each one is the same as. */
+	canon = g_new(gsize,nprof);
+	distinct = g_new(gsize,nprof);
+	was = g_new(gsize,nprof);
+	for(gsize p=0;p<nprof;p++) {
+		gsize d;
+		for(d=0;d<ndistinct;d++) {
+			const lomoji_profile_t *q = &profiles[distinct[d]];
+			if(q->ctx == profiles[p].ctx && q->filters == profiles[p].filters) break;
+		}
+		if(d == ndistinct) distinct[ndistinct++] = p;
+		canon[p] = distinct[d];
+	}
+
+	for(gsize i=0;i<nsrc;i++) {
+		GString **row = out + i*nprof;
+		const char *s = src[i] ? src[i] : "";
+		gsize len = strlen(s);
+
+		for(gsize p=0;p<nprof;p++) {
+			was[p] = row[p]->len;
+		}
+
+		if(ascii_same && ascii_span(s,s+len) == len) {
+			for(gsize p=0;p<nprof;p++) {
+				g_string_append_len(row[p],s,len);
+			}
+			continue;
+		}
+
+		for(gsize p=0;p<nprof;p++) {
+			if(canon[p] == p) {
+				into(profiles[p].ctx,s,profiles[p].filters,row[p]);
+				made++;
+			} else {
+				GString *from = row[canon[p]];
+				g_string_append_len(row[p],from->str + was[canon[p]],from->len - was[canon[p]]);
+			}
+		}
+	}
+
+	g_free(canon);
+	g_free(distinct);
+	g_free(was);
+	return(made);
+}
+
+gsize lomoji_to_ascii_batch(const char **src, gsize nsrc, const lomoji_profile_t *profiles, gsize nprof, GString **out) {
+	return(translate_batch(lomoji_to_ascii_into,1,src,nsrc,profiles,nprof,out));
+}
+
+gsize lomoji_from_ascii_batch(const char **src, gsize nsrc, const lomoji_profile_t *profiles, gsize nprof, GString **out) {
+	return(translate_batch(lomoji_from_ascii_into,0,src,nsrc,profiles,nprof,out));
+}
+
+
+static lomoji_stream_t *stream_new(lomoji_ctx_t *ctx, lomoji_filter **filters, int from) {
+	lomoji_stream_t *s = g_new0(lomoji_stream_t,1);
 
+	s->ctx = ctx;
+	s->filters = filters;
+	s->from = from;
+	s->carry = g_string_sized_new(STREAM_CARRYMAX);
+	return(s);
+}
+
+lomoji_stream_t *lomoji_stream_to_ascii(lomoji_ctx_t *ctx, lomoji_filter **filters) {
+	return(stream_new(ctx,filters,0));
+}
+
+lomoji_stream_t *lomoji_stream_from_ascii(lomoji_ctx_t *ctx, lomoji_filter **filters) {
+	return(stream_new(ctx,filters,1));
+}
+
+/* translate what it can of [p,stop) for s, returning how far it got. */
+static const gchar *stream_run(lomoji_stream_t *s, const gchar *p, const gchar *stop, int final, GString *out, stats_tally_t *tally) {
+	/* the same cases that the _into() functions just copy. */
+	if(!s->ctx || !s->filters || (s->from && !*s->ctx->tts_prefix)) {
+		out = g_string_append_len(out,p,stop-p);
+		return(stop);
+	}
+	if(s->from) {
+		return(from_ascii_run(s->ctx,s->filters,p,stop,final,out,tally));
+	}
+	return(to_ascii_run(s->ctx,ctx_pipeline(s->ctx,s->filters),s->filters,p,stop,final,out,tally));
+}
+
+static gsize stream_feed(lomoji_stream_t *s, const char *chunk, gsize len, GString *out, stats_tally_t *tally) {
+	const gchar *p, *stop, *used;
+	gsize was, old, take;
+
+	was = out->len;
+	p = chunk;
+	stop = chunk + len;
+
+	/* first settle what was held back, with as much of this chunk as it
+	 * takes to see how it ends. */
+	if(s->carry->len) {
+		old = s->carry->len;
+		take = MIN(len,STREAM_CARRYMAX);
+		g_string_append_len(s->carry,chunk,take);
+		used = stream_run(s,s->carry->str,s->carry->str + s->carry->len,0,out,tally);
+
+		if((gsize)(used - s->carry->str) >= old) {
+			/* settled, and it carries on in the chunk itself. */
+			p = chunk + ((used - s->carry->str) - old);
+			g_string_truncate(s->carry,0);
+		} else {
+			g_string_erase(s->carry,0,used - s->carry->str);
+			if(s->carry->len <= STREAM_CARRYMAX) {
+				/* that was all of the chunk. */
+				return(out->len - was);
+			}
+			/* too much to hold on to, so let it go as it is. */
+			stream_run(s,s->carry->str,s->carry->str + s->carry->len,1,out,tally);
+			g_string_truncate(s->carry,0);
+			p = chunk + take;
+		}
+	}
+
+	used = stream_run(s,p,stop,0,out,tally);
+	if((gsize)(stop - used) > STREAM_CARRYMAX) {
+		stream_run(s,used,stop,1,out,tally);
+	} else {
+		g_string_append_len(s->carry,used,stop - used);
+	}
+	return(out->len - was);
+}
+
+gsize lomoji_stream_feed(lomoji_stream_t *s, const char *chunk, gsize len, GString *out) {
+	stats_tally_t tally;
+	gsize made;
+
+	if(!s || !out || !chunk) return(0);
+
+	STATS_START(&tally,s->from);
+	made = stream_feed(s,chunk,len,out,&tally);
+	STATS_CALL(s->ctx,s->from,len,made,&tally);
+	return(made);
+}
+
+gsize lomoji_stream_flush(lomoji_stream_t *s, GString *out) {
+	stats_tally_t tally;
+	gsize was;
+
+	if(!s || !out) return(0);
+
+	STATS_START(&tally,s->from);
+	was = out->len;
+	stream_run(s,s->carry->str,s->carry->str + s->carry->len,1,out,&tally);
+	g_string_truncate(s->carry,0);
+	STATS_CALL(s->ctx,s->from,0,out->len - was,&tally);
+	return(out->len - was);
+}
+
+void lomoji_stream_free(lomoji_stream_t *s) {
+	if(!s) return;
+	g_string_free(s->carry,TRUE);
+	g_free(s);
 }
 
 
 /* strip the tts_prefix from beginning and optional tss_suffix from the end of
- * input string, returned as a dup.  caller must free the returned string. */
-gchar *keypart_dup(lomoji_ctx_t *ctx, char *in) {
-	gchar *ret = NULL;
-	gchar *stopat = NULL;
-	int stop;
+ * the len bytes at in, returned as a dup.  caller must free the returned
+ * string. */
+gchar *keypart_dup_n(lomoji_ctx_t *ctx, const char *in, gsize len) {
+	const gchar *stopat;
+	gsize prefixlen, suffixlen, keylen;
+
+	if(!ctx || !in) return(NULL);
 
 	/* suggestion MUST start with the tts_prefix. */
 	/* removed if present. */
-	int start = strlen(ctx->tts_prefix);
-	if(strncmp(in,ctx->tts_prefix,start) !=0)  {
+	prefixlen = strlen(ctx->tts_prefix);
+	suffixlen = strlen(ctx->tts_suffix);
+	if(len < prefixlen || strncmp(in,ctx->tts_prefix,prefixlen) != 0)  {
 		/* it does not. */
-		return(ret);
+		return(NULL);
 	}
 
-	/* suggestion MAY end with the tts_suffix. don't include that in the key. */
-	if( (stopat = g_strstr_len(in+start,-1,ctx->tts_suffix)) ) {
-		stop = stopat - in;
-	} else {
-		stop = -1;
+	/* suggestion MAY end with the tts_suffix. don't include that in the key.
+	 * Nor anything from a nul on, as if the string ended there. */
+	keylen = len - prefixlen;
+	if( (stopat = memchr(in+prefixlen,'\0',keylen)) ) {
+		keylen = stopat - (in+prefixlen);
+	}
+	if(suffixlen && (stopat = g_strstr_len(in+prefixlen,keylen,ctx->tts_suffix))) {
+		keylen = stopat - (in+prefixlen);
 	}
-	
 
-	ret = g_utf8_substring( in,start,stop );
-	if(strlen(ret) == 0 ) {
-		g_free(ret);
-		ret = NULL;
+	if(keylen == 0) {
+		return(NULL);
 	}
-	return(ret);
+	return(g_strndup(in+prefixlen,keylen));
 } 
 
+gchar *keypart_dup(lomoji_ctx_t *ctx, char *in) {
+	if(!in) return(NULL);
+	return(keypart_dup_n(ctx,in,strlen(in)));
+}
+
 
 /* Returns a space separated string containing no more than max possible
  * suggestions.  Returns NULL if no suggestions exist.  Caller must free the
  * returned string. */
-char *lomoji_suggest_ext(lomoji_ctx_t *ctx, char *src, int max, int *found) {
+char *lomoji_suggest_n(lomoji_ctx_t *ctx, const char *src, gsize len, int max, int *found) {
 	
-	GTreeNode *node;
-	gchar *k, *keypart;
+	alias_cursor node;
+	const gchar *k;
+	gchar *keypart;
+	gsize keylen;
 	int count = 0;
 	char *ret = NULL;
 	int gotone = 0;
-	
-	
-	GString *out = g_string_new("");
+	GString *out;
 
-	if(!ctx | !src | !*src) {
+	if(!ctx || !src || !len) {
 		return(ret);
 	}
 
-	if (!(keypart = keypart_dup(ctx,src))) {
+	if (!(keypart = keypart_dup_n(ctx,src,len))) {
 		return(ret);
 	}
 
-	node = g_tree_lower_bound(ctx->alias_cp,keypart);
-	while(node && ((max==0)||(count<max))) {
-		k = g_tree_node_key(node);
-		if( strncmp(k,keypart,strlen(keypart)) != 0) {
+	out = g_string_new("");
+	keylen = strlen(keypart);
+	alias_seek(ctx,&node,keypart);
+	while(alias_key(&node) && ((max==0)||(count<max))) {
+		k = alias_key(&node);
+		if( strncmp(k,keypart,keylen) != 0) {
 			/* src is no longer a prefix of k. */
 			break;
 		}
@@ -915,7 +4987,7 @@ char *lomoji_suggest_ext(lomoji_ctx_t *ctx, char *src, int max, int *found) {
 		out = g_string_append(out,k);
 		out = g_string_append(out,ctx->tts_suffix);
 		out = g_string_append(out," ");
-		node = g_tree_node_next(node);
+		alias_next(&node);
 		count++;
 		if(found) (*found)++;
 	}
@@ -927,6 +4999,11 @@ char *lomoji_suggest_ext(lomoji_ctx_t *ctx, char *src, int max, int *found) {
 	return(ret);
 }
 
+char *lomoji_suggest_ext(lomoji_ctx_t *ctx, char *src, int max, int *found) {
+	if(!src) return(NULL);
+	return(lomoji_suggest_n(ctx,src,strlen(src),max,found));
+}
+
 const char *lomoji_get_param_ext(lomoji_ctx_t *ctx, lomoji_param which) {
 	if(!ctx) return(NULL);
 		
@@ -947,6 +5024,11 @@ const char *lomoji_get_param_ext(lomoji_ctx_t *ctx, lomoji_param which) {
 const char *lomoji_set_param_ext(lomoji_ctx_t *ctx, lomoji_param which, const char *to) {
 	if(!ctx) return(NULL);
 	if(!to) return(NULL);
+	if(ctx->published) {
+		errno = EBUSY;
+		return(NULL);
+	}
+	ctx_changed(ctx);
 		
 	switch (which) {
 		case LOMOJI_PREFIX:
@@ -967,6 +5049,8 @@ const char *lomoji_set_param_ext(lomoji_ctx_t *ctx, lomoji_param which, const ch
 void lomoji_init(void) {
 	errno = 0;
 	lomoji_init_filepaths();
+	/* it isn't published, so it can still be changed in place, with the
+	 * _ext functions, until the caller publishes a context of their own. */
 	lomoji_default_ctx = lomoji_ctx_new(lomoji_default_filepaths);
 }
 
@@ -1018,23 +5102,92 @@ void lomoji_done_filepaths(void) {
 
 void lomoji_done(void) {
 	lomoji_done_filepaths();
-	if(lomoji_default_ctx) {
-		lomoji_ctx_free(lomoji_default_ctx);
-	}
+	/* unpublish it, so that it's freed once any readers are done. */
+	lomoji_ctx_publish(NULL);
 }
 char *lomoji_to_ascii(char *src) {
-	return(lomoji_to_ascii_ext(lomoji_default_ctx,src,lomoji_toascii));
+	lomoji_ctx_t *ctx = lomoji_ctx_acquire();
+	char *ret = lomoji_to_ascii_ext(ctx,src,lomoji_toascii);
+	lomoji_ctx_release(ctx);
+	return(ret);
 }
 char *lomoji_from_ascii(char *src) {
-	return(lomoji_from_ascii_ext(lomoji_default_ctx,src,lomoji_fromascii));
+	lomoji_ctx_t *ctx = lomoji_ctx_acquire();
+	char *ret = lomoji_from_ascii_ext(ctx,src,lomoji_fromascii);
+	lomoji_ctx_release(ctx);
+	return(ret);
 }
 char *lomoji_suggest(char *src, int max, int *found) {
-	return(lomoji_suggest_ext(lomoji_default_ctx,src,max,found));
+	lomoji_ctx_t *ctx = lomoji_ctx_acquire();
+	char *ret = lomoji_suggest_ext(ctx,src,max,found);
+	lomoji_ctx_release(ctx);
+	return(ret);
 }
 
+/* the string is the default context's, so it goes when that does.  Holding
+ * the reference only covers reading the pointer. */
 const char *lomoji_get_param(lomoji_param which) {
-	return(lomoji_get_param_ext(lomoji_default_ctx,which));
+	lomoji_ctx_t *ctx = lomoji_ctx_acquire();
+	const char *ret = lomoji_get_param_ext(ctx,which);
+	lomoji_ctx_release(ctx);
+	return(ret);
+}
+
+/* a copy of a frozen context, to change and publish in its place.  The image
+ * is shared rather than copied, mapped or not, and so are the statistics, so
+ * the counts carry on.  The cache starts empty, with the same budget.  The
+ * compiled filter lists depend on the settings, so lomoji_set_param()
+ * compiles them again once the copy has its new one. */
+static lomoji_ctx_t *ctx_copy(lomoji_ctx_t *ctx) {
+	lomoji_ctx_t *new;
+
+	new = ctx_alloc(ctx->tts_prefix,ctx->tts_suffix,ctx->unknown);
+	g_atomic_int_inc(&ctx->snap->refs);
+	new->snap = ctx->snap;
+	new->stats = stats_share(g_atomic_pointer_get(&ctx->stats));
+	if(ctx->cache) new->cache = cache_new(ctx->cache->budget);
+
+	for(guint i=0;i<ctx->sources->len;i++) {
+		lomoji_source_t *from = g_ptr_array_index(ctx->sources,i);
+		lomoji_source_t *src = g_new0(lomoji_source_t,1);
+		src->path = g_strdup(from->path);
+		src->mtime = from->mtime;
+		src->size = from->size;
+		g_ptr_array_add(new->sources,src);
+	}
+	new->alias_from = new->sources->len;
+
+	return(new);
 }
+
+/* the default context is published, so it can't be changed where it is.
+ * Change a copy and publish that instead.  Readers still holding the old one
+ * keep the old setting until they let go of it. */
 const char *lomoji_set_param(lomoji_param which, const char *to) {
-	return(lomoji_set_param_ext(lomoji_default_ctx,which,to));
+	static GMutex lock;
+	lomoji_ctx_t *ctx, *new;
+	const char *ret = NULL;
+
+	/* one at a time, or two setters would each publish a copy with only
+	 * their own change in it. */
+	g_mutex_lock(&lock);
+	if( !(ctx = lomoji_ctx_acquire()) ) {
+		errno = EPERM;
+	} else if(!ctx->published) {
+		/* put in place by hand, without publishing. */
+		ret = lomoji_set_param_ext(ctx,which,to);
+	} else {
+		new = ctx_copy(ctx);
+		if( (ret = lomoji_set_param_ext(new,which,to)) ) {
+			/* what the old one had compiled, with the new setting. */
+			for(guint i=0;ctx->pipes && i<ctx->pipes->len;i++) {
+				lomoji_pipeline_compile(new,((pipeline_t *)g_ptr_array_index(ctx->pipes,i))->filters);
+			}
+			if(lomoji_ctx_publish(new)) ret = NULL;
+		}
+		if(!ret) ctx_unref(new);
+	}
+	lomoji_ctx_release(ctx);
+	g_mutex_unlock(&lock);
+	return(ret);
 }
@@ -43,7 +43,9 @@
  * 
  * This function should be called first, before using any of the other
  * functions in the basic set.  It sets up a default context from the default
- * annotations file locations, with default operating parameters. 
+ * annotations file locations, with default operating parameters.  It isn't
+ * published, so it can be changed in place (with the _ext functions and
+ * lomoji_default_ctx) until a context is published with lomoji_ctx_publish().
  *
  * The annotation files are merged in order from default.xml, derived.xml, and
  * extra.xml out of the $(SHARE_PREFIX)/lomoji directory, then from the
@@ -125,7 +127,11 @@ typedef enum {
  *
  * Return Value - a const null terminated string, pointing to the configured
  * value, or NULL in case of error.  The caller does NOT own this string, and
- * should NOT free the returned value.
+ * should NOT free the returned value.  It belongs to the default context, and
+ * is good until the parameter is next set, or the default context is replaced
+ * (by lomoji_ctx_publish() or lomoji_done()).  A thread that needs it for
+ * longer than that, with other threads changing the default, should pin the
+ * context with lomoji_ctx_acquire() and use lomoji_get_param_ext() instead.
  */
 const char *lomoji_get_param(lomoji_param which); 
 
@@ -137,9 +143,16 @@ const char *lomoji_get_param(lomoji_param which);
  * string.  The 'to' parameter is strdup'ed into the context, and ownership of
  * 'to' stays with the caller.
  *
+ * If the default context has been published, it is never changed in place.
+ * A copy of it is made with the new value, and published in its place.  Calls
+ * already under way finish with the old value.  The copy shares the frozen
+ * tables (or the mapped snapshot) and the statistics with the old one, and
+ * gets a cache of the same size and the same filter lists compiled, so it
+ * costs about as much as compiling those lists again.
+ *
  * Return Value - a const char *, pointing to the configured value, or NULL in
  * case of error.  The caller does NOT own this string, and should NOT free the
- * returned value.
+ * returned value.  It is good for as long as lomoji_get_param()'s would be.
  */
 const char *lomoji_set_param(lomoji_param which, const char *to);
 
@@ -160,14 +173,30 @@ const char *lomoji_set_param(lomoji_param which, const char *to);
  * strings. */
 typedef struct lomoji_ctx_s lomoji_ctx_t;
 
+/* lomoji_pool_t is a set of contexts for different locales, that share what
+ * they have in common.  See lomoji_pool_new(). */
+typedef struct lomoji_pool_s lomoji_pool_t;
+
 /* codepoint filter functions take this form. */
 typedef int lomoji_filter(lomoji_ctx_t *ctx, gchar *check, GString **out);
 
+/* Counted forms of the filter functions take this form.  Instead of a
+ * nul-terminated copy of the grapheme, they get a pointer to where it sits in
+ * the source string, and its length in bytes.  The builtin filters all have a
+ * counted form, which is what the translators call when the builtin appears in
+ * a filter list.  A custom filter's counted form is registered with
+ * lomoji_filter_counted(). */
+typedef int lomoji_filter_n(lomoji_ctx_t *ctx, const gchar *check, gsize len, GString **out);
+
 /*--- exported global variable declarations ---*/
 
 /* lomoji_default_ctx - the context created by lomoji_init, and is used by the
  * 'basic' lomoji functions. It is exposed here so that, after calling
- * lomoji_init(), caller can specify it with param commands. */
+ * lomoji_init(), caller can specify it with param commands.  Once a context
+ * has been published with lomoji_ctx_publish(), it is read-only, and the _ext
+ * functions that change it return EBUSY.  From then on, change it with
+ * lomoji_set_param(), or publish another, and read it with
+ * lomoji_ctx_acquire() rather than through this pointer. */
 extern lomoji_ctx_t *lomoji_default_ctx;
 
 /* lomoji_default_filepaths - a list of filepath locations that is initialized
@@ -181,20 +210,330 @@ extern char **lomoji_default_filepaths;
  * no annotations files are loaded.  Annotations can be merged later with
  * lomoji_add_annotations().  lomoji_default_filepaths may be used for the
  * initial annotations as long as lomoji_init() or lomoji_init_filepaths() has
- * been called first.
+ * been called first.  The aliases that translating from ascii and suggesting
+ * use are only indexed the first time one of those needs them, so a context
+ * that only ever translates to ascii never pays for them.
  *
  * Return Value - a new context pointer.  Caller must free with
  * lomoji_ctx_free().
  */
 lomoji_ctx_t *lomoji_ctx_new(char **annotations);
 
+/* lomoji_ctx_new_refreshable() - create a context that refreshes cheaply.
+ *
+ * The same as lomoji_ctx_new(), except that the context keeps a record of the
+ * names and aliases each annotations file put into it, so that
+ * lomoji_ctx_refresh() can redo just the files that changed.  The record
+ * costs about a third again as much heap as the context itself, once its
+ * aliases are indexed.  Without it, a refresh re-reads every file, which
+ * gives the same result, only more slowly.
+ * Overlays from lomoji_ctx_derive() keep a record if their base does.
+ *
+ * Return Value - a new context pointer.  Caller must free with
+ * lomoji_ctx_free().
+ */
+lomoji_ctx_t *lomoji_ctx_new_refreshable(char **annotations);
+
 /* lomoji_ctx_free() - deallocates a context pointer.
  *
- * Deallocates the entirety of a lomoji_ctx_t context pointer.
+ * Deallocates the entirety of a lomoji_ctx_t context pointer, including the
+ * context itself, which must not be used (or free()'d) afterwards.  The
+ * tables' strings are all kept in one arena per context, so this is quick
+ * even for a large set of annotations.  A context that still has overlays
+ * from lomoji_ctx_derive() is only really freed along with the last of them.
  *
  */
 void lomoji_ctx_free(lomoji_ctx_t *f);
 
+/* lomoji_ctx_derive() - create an overlay on a context.
+ *
+ * Creates a context that translates with base's tables, without copying
+ * them, and keeps only what is changed in it: its own parameters (which start
+ * out as base's), and whatever is added to it with lomoji_add_alias(),
+ * lomoji_add_annotations() and the like.  Lookups try the overlay's own
+ * entries first, then base's, so an overlay can give a player their own
+ * markers and aliases for a few kilobytes.  An alias in an annotations file
+ * merged into an overlay is skipped if base already has it, the same as it
+ * would be in base itself.  base may be published, and overlays may be
+ * derived from it on any thread.  base may be an overlay itself, and lookups
+ * go down the chain, up to 8 contexts deep.  An overlay also uses base's memo
+ * of the slow fallback filters where its output would be the same, and its
+ * calls are counted in base's statistics, so one with an alias or two takes
+ * about 2KB.
+ *
+ * base holds still for its overlays: until the last of them is freed, adding
+ * to its tables or freezing it fails with EBUSY, and it isn't freed.  An
+ * overlay can't be published, frozen or saved as a snapshot (EINVAL), and
+ * deriving from the end of a chain that is already 8 deep fails the same way.
+ *
+ * Return Value - a new context, which the caller frees with
+ * lomoji_ctx_free(), or NULL with errno set on failure.
+ */
+lomoji_ctx_t *lomoji_ctx_derive(lomoji_ctx_t *base);
+
+/* lomoji_pool_new() - create a pool of locale contexts.
+ *
+ * A pool holds a context for each of a number of locales, loaded from their
+ * CLDR annotations files with lomoji_pool_add().  The equivalents, regional
+ * indicators and oneoffs are made once, for the whole pool, and each locale is
+ * an overlay (see lomoji_ctx_derive()) on the one it falls back to, so it
+ * holds only its own names and aliases, and anything it doesn't have is
+ * looked up in the locale after it in the chain.  de_CH falls back to de,
+ * and a locale with no parent in the pool falls back to the fallback locale,
+ * if that's given and in the pool.  So with a fallback of "en", de_CH goes
+ * to de, then to en.
+ *
+ * Return Value - a new pool, which the caller frees with lomoji_pool_free().
+ */
+lomoji_pool_t *lomoji_pool_new(const char *fallback);
+
+/* lomoji_pool_add() - load a locale into a pool.
+ *
+ * Makes a context for locale (as "de_CH" or "de-CH") from the annotations
+ * files in annotations, which are merged as by lomoji_add_annotations().  A
+ * locale's parents, and the fallback locale, must be added before it to be
+ * in its chain, and once a locale has others falling back to it, it can't be
+ * changed.  Locales may not be added while another thread is using the pool.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  EEXIST if
+ * locale is in the pool already, ENOENT if none of the files could be opened.
+ */
+int lomoji_pool_add(lomoji_pool_t *pool, const char *locale, char **annotations);
+
+/* lomoji_pool_get() - the context for a locale.
+ *
+ * Looks up locale in pool, or if it isn't there, the locale it would fall
+ * back to: de for de_AT, then the fallback locale, and at the very end a
+ * context with no names at all, only the equivalents and oneoffs.  A NULL
+ * locale gets the fallback locale's.  It translates like any other context,
+ * from any number of threads at once, and can be derived from, but it belongs
+ * to the pool and goes with it.
+ *
+ * Return Value - a context that the caller must NOT free, or NULL with errno
+ * set if pool is NULL.
+ */
+lomoji_ctx_t *lomoji_pool_get(lomoji_pool_t *pool, const char *locale);
+
+/* lomoji_pool_free() - deallocate a pool.
+ *
+ * Frees pool and its locales.  A locale that has overlays from
+ * lomoji_ctx_derive() outside of the pool lasts until they are freed.
+ */
+void lomoji_pool_free(lomoji_pool_t *pool);
+
+/* lomoji_ctx_save() - write a context out as a binary snapshot.
+ *
+ * Writes the merged annotations, equivalents, aliases and operating
+ * parameters of ctx to a binary snapshot file at path, along with the list of
+ * annotation files (and their modification times) that went into it.  The
+ * file is written to a temporary name and renamed into place, so processes
+ * that already have the old snapshot open are not disturbed.
+ *
+ * Return Value - 0 on success, or an errno value on failure.
+ */
+int lomoji_ctx_save(lomoji_ctx_t *ctx, const char *path);
+
+/* lomoji_ctx_open_snapshot() - create a context from a binary snapshot.
+ *
+ * Maps a snapshot file written by lomoji_ctx_save() and serves lookups
+ * directly out of the mapped pages, instead of parsing the annotation XML.
+ * Processes that open the same snapshot share its memory.  If any of the
+ * annotation files the snapshot was made from have changed since, or the
+ * snapshot was written by an incompatible version of liblomoji, the context is
+ * instead built from those annotation files as lomoji_ctx_new() would.
+ *
+ * Opening only checks the snapshot's header and that its sections are inside
+ * the file, so that it doesn't read the whole file in.  Table entries are
+ * checked as they are looked up, and a broken one is treated as missing.
+ *
+ * A snapshot context may still be modified with lomoji_add_annotations() and
+ * friends, but it will be copied out of the snapshot into memory first.
+ *
+ * Return Value - a new context pointer that the caller must free with
+ * lomoji_ctx_free(), or NULL with errno set if path could not be opened or
+ * is not a snapshot file.  errno is 0 if the context is served from the
+ * snapshot, or ESTALE if it had to be built from the annotation files, in
+ * which case the caller will want to lomoji_ctx_save() it over the old one.
+ */
+lomoji_ctx_t *lomoji_ctx_open_snapshot(const char *path);
+
+/* lomoji_ctx_freeze() - compile a context into a read-only form.
+ *
+ * Once a context is done loading annotations, freezing it packs its tables
+ * into one contiguous block with a minimal perfect hash over the codepoints,
+ * the same form a snapshot file is in.  A frozen context uses less memory and
+ * looks graphemes up faster, and since nothing in it changes, any number of
+ * threads may translate with it at once.  (Calling lomoji_set_param_ext() is
+ * still a change, and must not race with those threads.)  Contexts opened
+ * with lomoji_ctx_open_snapshot() are already frozen.
+ *
+ * Modifying a frozen context with lomoji_add_annotations() and friends thaws
+ * it back into the ordinary form first.
+ *
+ * Return Value - 0 on success, or an errno value on failure, in which case
+ * the context is left as it was.  A context with overlays from
+ * lomoji_ctx_derive() can't be frozen until they are gone, and returns EBUSY.
+ */
+int lomoji_ctx_freeze(lomoji_ctx_t *ctx);
+
+/* lomoji_ctx_refresh() - pick up changes to a context's annotation files.
+ *
+ * Checks the modification time and size of each annotation file that went
+ * into ctx, and re-reads only the ones that changed (or appeared, or went
+ * away).  Only the names and aliases those files had before or have now are
+ * worked out again, with the files still merged in their original order, so
+ * the result is the same as building the context over again, but the cost is
+ * in proportion to the changed files.  That needs a record of what each file
+ * held, which only a context from lomoji_ctx_new_refreshable() keeps.  Any
+ * other context, and a frozen or snapshot one, is thawed and has all of its
+ * files re-read.
+ * Equivalents added with lomoji_add_equiv() are kept as they are.
+ *
+ * Return Value - 0 on success (including when nothing changed), or an errno
+ * value on failure.  A published context can't be refreshed, and returns
+ * EBUSY.
+ */
+int lomoji_ctx_refresh(lomoji_ctx_t *ctx);
+
+/* lomoji_ctx_publish() - make ctx the shared default context.
+ *
+ * Atomically replaces lomoji_default_ctx with ctx, so that annotations can be
+ * reloaded or parameters changed while other threads are translating.  Build
+ * and configure the new context first (on any thread), then publish it.  ctx
+ * is frozen as by lomoji_ctx_freeze(), and from then on it is read-only:
+ * lomoji_add_annotations(), lomoji_set_param_ext() and friends fail on it with
+ * EBUSY.  Publishing takes over the caller's reference to ctx, so the caller
+ * must not lomoji_ctx_free() it.  The context being replaced is freed once the
+ * last thread that acquired it releases it.  The unpublished context that
+ * lomoji_init() sets up can be published where it is, with
+ * lomoji_ctx_publish(lomoji_default_ctx), once it is configured.  Publishing
+ * NULL takes the default context down, which is what lomoji_done() does.
+ *
+ * Publishers are serialized with each other, but never block readers.
+ *
+ * Return Value - 0 on success, or an errno value on failure, in which case
+ * lomoji_default_ctx is left as it was.
+ */
+int lomoji_ctx_publish(lomoji_ctx_t *ctx);
+
+/* lomoji_ctx_acquire(), lomoji_ctx_release() - pin the default context.
+ *
+ * lomoji_ctx_acquire() returns the current lomoji_default_ctx with a
+ * reference held on it, without taking a lock.  The context stays valid until
+ * it is handed back with lomoji_ctx_release(), even if a new one is published
+ * in the meantime.  A thread should acquire once per unit of work (a message,
+ * say) and translate with lomoji_to_ascii_ext() and friends, rather than
+ * reading lomoji_default_ctx directly.  The basic set functions do this for
+ * each call.  Strings returned by lomoji_get_param_ext() are only good for as
+ * long as the context they came from, so hold on to it while using them.
+ *
+ * Return Value - lomoji_ctx_acquire() returns the pinned context, or NULL if
+ * there is none.  Releasing NULL does nothing.
+ */
+lomoji_ctx_t *lomoji_ctx_acquire(void);
+void lomoji_ctx_release(lomoji_ctx_t *ctx);
+
+/* lomoji_ctx_set_cache() - remember recent translations made with a context.
+ *
+ * Gives ctx a cache of up to budget bytes of whole-string translations, so
+ * that translating a string that was translated recently (a prompt, a room
+ * title, a channel tag) copies out the earlier result instead of running the
+ * filters again.  Translations are looked up by their bytes, the direction,
+ * and the address of the filter list, so a filter list's contents must not be
+ * changed while a cache is in use, and filters whose output can change from
+ * call to call shouldn't be cached.  Plain strings that translate as
+ * themselves are not cached.  When the cache is full, the translations least
+ * recently used are dropped.  The cache is emptied whenever
+ * lomoji_set_param_ext(), lomoji_add_annotations() or friends change the
+ * context.  A budget of 0 removes the cache, which is the default.  The cache
+ * of a published context is shared by all of the threads translating with it.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  The cache can't
+ * be changed on a published context, which returns EBUSY.
+ */
+int lomoji_ctx_set_cache(lomoji_ctx_t *ctx, gsize budget);
+
+/* lomoji_cache_stats_t - how well a context's cache is doing. */
+typedef struct {
+	guint64 hits;		/* translations copied out of the cache. */
+	guint64 misses;		/* translations that had to be made. */
+	gsize entries;		/* translations in the cache now. */
+	gsize bytes;		/* what they take up. */
+	gsize budget;		/* what they may take up. */
+} lomoji_cache_stats_t;
+
+/* lomoji_ctx_cache_stats() - fill in stats for ctx's translation cache.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  A context
+ * without a cache gets all zeroes.
+ */
+int lomoji_ctx_cache_stats(lomoji_ctx_t *ctx, lomoji_cache_stats_t *stats);
+
+/* lomoji_stat_filter - what took a grapheme or :name: token, for the filter
+ * counts in lomoji_stats_t. */
+typedef enum {
+	LOMOJI_STAT_TONAME,
+	LOMOJI_STAT_EQUIV,
+	LOMOJI_STAT_DECOMPOSE,
+	LOMOJI_STAT_UNKNOWN,
+	LOMOJI_STAT_FROMNAME,
+	LOMOJI_STAT_UPLUS,
+	LOMOJI_STAT_ICONV,
+	LOMOJI_STAT_CUSTOM,	/* a filter other than the ones above. */
+	LOMOJI_STAT_COMPILED,	/* a lomoji_pipeline_compile() table. */
+	LOMOJI_STAT_NONE,	/* no filter, so it was copied as it was. */
+	LOMOJI_STAT_MAX
+} lomoji_stat_filter;
+
+/* calls taking from 2^i up to 2^(i+1) nanoseconds go in latency bucket i. */
+#define LOMOJI_STATS_BUCKETS 32
+
+/* lomoji_stats_t - what a context has been doing. */
+typedef struct {
+	guint64 to_calls;		/* strings translated to ascii. */
+	guint64 to_bytes_in;
+	guint64 to_bytes_out;
+	guint64 ascii_bytes;		/* bytes that went straight through. */
+	guint64 to_filtered[LOMOJI_STAT_MAX];	/* graphemes, by what took them. */
+	guint64 to_timed;		/* calls that were timed, */
+	guint64 to_ns;			/* the time they took, */
+	guint64 to_latency[LOMOJI_STATS_BUCKETS];	/* and how it spread. */
+	guint64 from_calls;		/* strings translated from ascii. */
+	guint64 from_bytes_in;
+	guint64 from_bytes_out;
+	guint64 from_filtered[LOMOJI_STAT_MAX];	/* tokens, by what took them. */
+	guint64 from_timed;
+	guint64 from_ns;
+	guint64 from_latency[LOMOJI_STATS_BUCKETS];
+} lomoji_stats_t;
+
+/* lomoji_ctx_stats() - fill in what ctx has been doing.
+ *
+ * Every translation with ctx is counted: the calls to lomoji_to_ascii_*()
+ * and lomoji_from_ascii_*() (a stream counts each feed and flush as a call),
+ * the bytes in and out, and which filter took each grapheme or :name: token.
+ * A from_filtered[LOMOJI_STAT_NONE] is a token that no filter knew.  Reading
+ * the clock costs about as much as a short call, so only a sample of the
+ * calls (one in 16 on each thread) are timed.  Counting is spread across
+ * threads without locking, and the totals are added up when asked for, so a
+ * total taken while other threads are translating may be a few counts out.
+ * Calls made with an overlay from lomoji_ctx_derive() are counted in the
+ * context at the bottom of its chain, and asking an overlay for its
+ * statistics (or resetting them) gets that context's.  The counting can be
+ * left out of the library altogether by building it with -DLOMOJI_NO_STATS.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  A library built
+ * without statistics returns ENOSYS, and all zeroes.
+ */
+int lomoji_ctx_stats(lomoji_ctx_t *ctx, lomoji_stats_t *stats);
+
+/* lomoji_ctx_stats_reset() - start ctx's statistics over from zero.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  A library built
+ * without statistics returns ENOSYS.
+ */
+int lomoji_ctx_stats_reset(lomoji_ctx_t *ctx);
+
 /* Calls to initialize and dispose of lomoji_default_filepaths.  Only required
  * if user is NOT calling lomoji_init() and lomoji_done(), but still wishes to
  * use lomoji_default_filepaths in a lomoji_new() or lomoji_add_annotations()
@@ -209,9 +548,177 @@ char *lomoji_to_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters)
 char *lomoji_from_ascii_ext(lomoji_ctx_t *ctx, char *src, lomoji_filter **filters);
 char *lomoji_suggest_ext(lomoji_ctx_t *ctx, char *in, int max, int *found);
 int lomoji_add_annotations(lomoji_ctx_t *ctx, char **annotations);
+
+/* lomoji_add_alias() - make :alias: translate from ascii to cp.
+ *
+ * alias is made into a key the same way as one in an annotations file, and
+ * replaces any alias already there with that key.  It is remembered along
+ * with where it came among the annotations files, so lomoji_ctx_refresh()
+ * puts it back in the same place: a changed file merged before it can't
+ * replace it, and one merged after it (with lomoji_add_annotations()) still
+ * can.  Meant mostly for overlays, from lomoji_ctx_derive().
+ *
+ * Return Value - 0 on success, or an errno value on failure.  EINVAL if there
+ * is nothing left of alias once it's made into a key.
+ */
+int lomoji_add_alias(lomoji_ctx_t *ctx, const char *alias, const char *cp);
 const char *lomoji_get_param_ext(lomoji_ctx_t *ctx, lomoji_param which);
 const char *lomoji_set_param_ext(lomoji_ctx_t *ctx, lomoji_param which, const char *to);
 
+/* lomoji_to_ascii_into(), lomoji_from_ascii_into() - Translate into a buffer.
+ *
+ * These work like lomoji_to_ascii_ext() and lomoji_from_ascii_ext(), but
+ * instead of returning a new string, they append the translation of src to
+ * the end of the caller's GString 'out'.  A caller that keeps reusing the same
+ * GString (truncating it with g_string_truncate(out,0) between messages) does
+ * not have to allocate anything once the buffer has grown large enough.
+ *
+ * Return Value - the number of bytes appended to out.
+ */
+gsize lomoji_to_ascii_into(lomoji_ctx_t *ctx, const char *src, lomoji_filter **filters, GString *out);
+gsize lomoji_from_ascii_into(lomoji_ctx_t *ctx, const char *src, lomoji_filter **filters, GString *out);
+
+/* lomoji_to_ascii_n(), lomoji_from_ascii_n() - Translate a slice of a buffer.
+ *
+ * These work like lomoji_to_ascii_into() and lomoji_from_ascii_into(), but
+ * translate the len bytes at src, which don't need to be nul-terminated, and
+ * nothing past src+len is ever read.  A nul inside the slice is copied through
+ * like any other control character.  Nothing joins on to it, and a :name:
+ * ends at it, the same as at the end of a string.  A UTF-8 character cut short
+ * at the end of the slice is translated as a grapheme of its own, the same as
+ * one at the end of a nul-terminated string.
+ *
+ * Return Value - the number of bytes appended to out.
+ */
+gsize lomoji_to_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out);
+gsize lomoji_from_ascii_n(lomoji_ctx_t *ctx, const char *src, gsize len, lomoji_filter **filters, GString *out);
+
+/* lomoji_suggest_n() - lomoji_suggest_ext() for a slice of a buffer.
+ *
+ * Works like lomoji_suggest_ext(), but the name to complete is the len bytes
+ * at src, which don't need to be nul-terminated.  The name stops at a nul, if
+ * there is one.
+ *
+ * Return Value - as lomoji_suggest_ext().
+ */
+char *lomoji_suggest_n(lomoji_ctx_t *ctx, const char *src, gsize len, int max, int *found);
+
+/* keypart_dup(), keypart_dup_n() - Pull the name out of a :name: token.
+ *
+ * Strips the prefix from the start of in, and the suffix and anything after
+ * it, if there is one.  keypart_dup_n() takes the len bytes at in, which don't
+ * need to be nul-terminated, and stops at a nul if there is one.
+ *
+ * Return Value - the name, which the caller must g_free(), or NULL if in
+ * doesn't start with the prefix or the name is empty.
+ */
+gchar *keypart_dup(lomoji_ctx_t *ctx, char *in);
+gchar *keypart_dup_n(lomoji_ctx_t *ctx, const char *in, gsize len);
+
+/* lomoji_pipeline_compile() - fuse a filter list for lomoji_to_ascii_*().
+ *
+ * Works out ahead of time what the filter list makes of every grapheme ctx
+ * has a name or an equivalent for, prefix and suffix and all, and keeps that
+ * in ctx as one table.  From then on, translating to ascii with that filter
+ * list (the same pointer, such as lomoji_toascii) takes each of those
+ * graphemes with a single lookup and copy, rather than trying each filter in
+ * turn.  Other graphemes still go through the filters.  Only the builtin
+ * filters can be compiled: if the list has a custom filter in it, just the
+ * filters ahead of it are, and anything they don't substitute for goes on to
+ * the custom filter as usual.  Compiling the same list again replaces it.
+ * Changing ctx with lomoji_set_param_ext(), lomoji_add_annotations() or
+ * friends throws the compiled lists away, so compile once ctx is set up.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  EINVAL means the
+ * list is empty or starts with a custom filter, so there's nothing to
+ * compile, and a published context returns EBUSY.
+ */
+int lomoji_pipeline_compile(lomoji_ctx_t *ctx, lomoji_filter **filters);
+
+/* lomoji_profile_t - one way of translating a message, for the batch
+ * functions below.  Profiles with the same ctx and the same filters list
+ * (the same pointer, such as lomoji_toascii) are the same profile. */
+typedef struct {
+	lomoji_ctx_t *ctx;
+	lomoji_filter **filters;
+} lomoji_profile_t;
+
+/* lomoji_to_ascii_batch(), lomoji_from_ascii_batch() - Translate for many
+ * recipients at once.
+ *
+ * Translates each of the nsrc strings in src with each of the nprof profiles,
+ * appending the translation of src[i] with profiles[p] to the caller's
+ * GString out[i*nprof + p], as lomoji_to_ascii_into() would.  Each distinct
+ * profile translates a source only once, and the other recipients with that
+ * profile get a copy, so broadcasting a message costs in proportion to the
+ * number of distinct profiles rather than the number of recipients.  A source
+ * that is plain ASCII is the same in every profile of lomoji_to_ascii_batch(),
+ * and is just copied.  The GStrings in out must all be different ones.
+ *
+ * Return Value - the number of translations that were actually made.
+ */
+gsize lomoji_to_ascii_batch(const char **src, gsize nsrc, const lomoji_profile_t *profiles, gsize nprof, GString **out);
+gsize lomoji_from_ascii_batch(const char **src, gsize nsrc, const lomoji_profile_t *profiles, gsize nprof, GString **out);
+
+/* lomoji_stream_t - a translation in progress, for text that arrives in
+ * pieces.  The pieces don't have to break anywhere in particular. */
+typedef struct lomoji_stream_s lomoji_stream_t;
+
+/* lomoji_stream_to_ascii(), lomoji_stream_from_ascii() - Start a stream.
+ *
+ * Starts translating text with ctx and filters, as lomoji_to_ascii_into() or
+ * lomoji_from_ascii_into() would, for text that will be handed over a chunk
+ * at a time with lomoji_stream_feed().  ctx and filters must stay around
+ * until the stream is freed.
+ *
+ * Return Value - the new stream, to free with lomoji_stream_free().
+ */
+lomoji_stream_t *lomoji_stream_to_ascii(lomoji_ctx_t *ctx, lomoji_filter **filters);
+lomoji_stream_t *lomoji_stream_from_ascii(lomoji_ctx_t *ctx, lomoji_filter **filters);
+
+/* lomoji_stream_feed() - Translate the next chunk of a stream.
+ *
+ * Appends the translation of the len bytes at chunk to out, as far as it can
+ * be told yet.  A character, sequence or :name: token that might go on into
+ * the next chunk is held back until it is known how it ends, so a UTF-8
+ * character or ZWJ sequence split between two chunks comes out as if it had
+ * never been split.  At most a few hundred bytes are ever held back; past
+ * that the held back text is translated as it is.  chunk doesn't need to be
+ * nul-terminated.
+ *
+ * Return Value - the number of bytes appended to out.
+ */
+gsize lomoji_stream_feed(lomoji_stream_t *s, const char *chunk, gsize len, GString *out);
+
+/* lomoji_stream_flush() - End a stream's text, for now.
+ *
+ * Translates whatever is being held back as if nothing more were coming, and
+ * appends it to out.  The stream can be fed again afterwards, and starts
+ * fresh.
+ *
+ * Return Value - the number of bytes appended to out.
+ */
+gsize lomoji_stream_flush(lomoji_stream_t *s, GString *out);
+
+/* lomoji_stream_free() - Free a stream.  Anything still held back is lost,
+ * so flush first. */
+void lomoji_stream_free(lomoji_stream_t *s);
+
+/* lomoji_filter_counted() - register the counted form of a custom filter.
+ *
+ * From then on, wherever f appears in a filter list, the translators call fn
+ * instead, with a pointer into the source string rather than a copy of the
+ * grapheme.  fn must do what f does.  f itself is still what goes in the
+ * list, and what gets called by anything that doesn't know about fn.
+ * Registering f again replaces its counted form.  Filters should be
+ * registered before any thread translates with them.
+ *
+ * Return Value - 0 on success, or an errno value on failure.  EINVAL if f is
+ * one of the builtin filters, which have their counted forms already, and
+ * ENOSPC if 16 filters have been registered already.
+ */
+int lomoji_filter_counted(lomoji_filter *f, lomoji_filter_n *fn);
+
 /* These are some useful predefined filter lists for handing to lomoji_X_ascii_ext() */
 extern lomoji_filter *lomoji_toascii[];  	/* the basic default */
 extern lomoji_filter *lomoji_fromascii[];	/* the basic default */
@@ -230,4 +737,13 @@ lomoji_filter filter_unknown;
 lomoji_filter filter_uplus;
 lomoji_filter filter_decompose;
 
+/* the counted forms of the filter primitives, for use inside custom filters. */
+lomoji_filter_n filter_equiv_n;
+lomoji_filter_n filter_toname_n;
+lomoji_filter_n filter_fromname_n;
+lomoji_filter_n filter_iconv_n;
+lomoji_filter_n filter_unknown_n;
+lomoji_filter_n filter_uplus_n;
+lomoji_filter_n filter_decompose_n;
+
 #endif /* JHI_LOMOJI_H */